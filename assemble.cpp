@@ -0,0 +1,266 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ii-part.h"
+
+/*
+ * --build=focus|zip|microdrive output volume...: assemble a card image
+ * from ProDOS-order volume files (.po, .hdv, or a ProDOS-order .2mg).
+ *
+ * The header area is zeroed first and the real header written last, after
+ * the volumes are copied and synced, so a half-built image is never
+ * mistaken for a card.
+ */
+
+namespace {
+
+struct source
+{
+	const char *path;
+	int fd = -1;
+	off_t offset = 0; // of the data (non-zero for .2mg)
+	off_t size = 0;
+};
+
+// closes the input on the way out, keeping errno.
+bool fail(source &s)
+{
+	int error = errno;
+	if (s.fd >= 0) close(s.fd);
+	s.fd = -1;
+	errno = error;
+	return false;
+}
+
+void close_sources(std::vector<source> &sources)
+{
+	for (auto &s : sources) {
+		if (s.fd >= 0) close(s.fd);
+		s.fd = -1;
+	}
+}
+
+bool open_source(source &s, std::string &name)
+{
+	unsigned char data[512];
+	struct stat st;
+
+	s.fd = open(s.path, O_RDONLY);
+	if (s.fd < 0 || fstat(s.fd, &st) < 0) return fail(s);
+	s.size = st.st_size;
+
+	// .2mg: only ProDOS order will do.
+	unsigned format;
+	if (pread(s.fd, data, 64, 0) == 64 && !memcmp(data, "2IMG", 4)) {
+		if (!parse_2mg(data, st.st_size, s.offset, s.size, format) || format != IMG_PRODOS_ORDER) {
+			errno = EINVAL;
+			return fail(s);
+		}
+	}
+	if (!s.size || (s.size & 511) || s.offset + s.size > st.st_size) {
+		errno = EINVAL;
+		return fail(s);
+	}
+
+	// the volume name, or the file name without the extension.
+	name.clear();
+	if (s.size >= 512 * 3 && pread(s.fd, data, 512, s.offset + 512 * 2) == 512
+		&& read16(data) == 0 && (data[4] & 0xf0) == 0xf0 && (data[4] & 0x0f)) {
+		name.assign(data + 5, data + 5 + (data[4] & 0x0f));
+	}
+	if (name.empty()) {
+		const char *base = strrchr(s.path, '/');
+		name = base ? base + 1 : s.path;
+		name = name.substr(0, name.rfind('.'));
+	}
+	return true;
+}
+
+bool copy_range(int in, off_t in_offset, int out, off_t out_offset, off_t size)
+{
+	#if defined(__linux__)
+	while (size > 0) {
+		loff_t i = in_offset;
+		loff_t o = out_offset;
+		ssize_t ok = copy_file_range(in, &i, out, &o, size, 0);
+		if (ok < 0 && errno == EINTR) continue;
+		if (ok <= 0) break; // fall back to read/write
+		in_offset += ok;
+		out_offset += ok;
+		size -= ok;
+	}
+	#endif
+
+	std::vector<char> buffer(1 << 20);
+	while (size > 0) {
+		size_t chunk = std::min<off_t>(size, buffer.size());
+		ssize_t ok = pread(in, buffer.data(), chunk, in_offset);
+		if (ok < 0 && errno == EINTR) continue;
+		if (ok <= 0) {
+			if (ok == 0) errno = EIO;
+			return false;
+		}
+		ssize_t w = pwrite(out, buffer.data(), ok, out_offset);
+		if (w != ok) {
+			if (w >= 0) errno = EIO;
+			return false;
+		}
+		in_offset += ok;
+		out_offset += ok;
+		size -= ok;
+	}
+	return true;
+}
+
+bool write_zeros(int out, off_t offset, off_t size)
+{
+	std::vector<char> buffer(std::min<off_t>(size, 1 << 20), 0);
+	while (size > 0) {
+		ssize_t ok = pwrite(out, buffer.data(), std::min<off_t>(size, buffer.size()), offset);
+		if (ok <= 0) return false;
+		offset += ok;
+		size -= ok;
+	}
+	return true;
+}
+
+} // namespace
+
+
+int build_image(const char *kind, const char *output, const std::vector<const char *> &inputs)
+{
+	bool focus = !strcmp(kind, "focus") || !strcmp(kind, "zip");
+	bool zip = !strcmp(kind, "zip");
+	std::vector<source> sources(inputs.size());
+	std::vector<file_info> parts;
+	std::vector<unsigned char> header;
+
+	if (!focus && strcmp(kind, "microdrive")) {
+		warnx("unknown scheme %s (focus, zip or microdrive)", kind);
+		return EX_USAGE;
+	}
+	if (inputs.empty()) {
+		warnx("no volumes");
+		return EX_USAGE;
+	}
+
+	off_t first = (off_t)(focus ? FOCUS_HEADER_BLOCKS : MICRODRIVE_FIRST_BLOCK) * 512;
+	off_t offset = first;
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		source &s = sources[i];
+		file_info f;
+
+		s.path = inputs[i];
+		if (!open_source(s, f.name)) {
+			warn("%s", s.path);
+			close_sources(sources);
+			return EX_DATAERR;
+		}
+		if (!focus) {
+			unsigned drive = i < MICRODRIVE_MAX ? 1 : 2;
+			unsigned index = i < MICRODRIVE_MAX ? i : i - MICRODRIVE_MAX;
+			f.name = "MicroDrive" + std::to_string(drive) + "-" + std::to_string(index + 1);
+		}
+		f.start = offset;
+		f.size = s.size;
+		offset += s.size;
+		parts.push_back(std::move(f));
+	}
+	off_t total = offset;
+
+	bool ok = focus ? make_focus_header(parts, zip, header) : make_microdrive_header(parts, header);
+	if (!ok) {
+		warnx("volumes don't fit a %s header (too many or too large)", kind);
+		close_sources(sources);
+		return EX_DATAERR;
+	}
+
+	int out = open(output, O_WRONLY | O_CREAT, 0666);
+	if (out < 0) {
+		warn("%s", output);
+		close_sources(sources);
+		return EX_CANTCREAT;
+	}
+
+	struct stat st;
+	fstat(out, &st);
+	if (S_ISREG(st.st_mode)) {
+		if (ftruncate(out, total) < 0) {
+			warn("%s", output);
+			close_sources(sources);
+			close(out);
+			return EX_IOERR;
+		}
+		#if defined(__linux__)
+		// errors just mean the filesystem can't preallocate.
+		posix_fallocate(out, 0, total);
+		#endif
+	} else if (file_size(out) < total) {
+		warnx("%s: too small (%lld blocks needed)", output, (long long)total / 512);
+		close_sources(sources);
+		close(out);
+		return EX_DATAERR;
+	}
+
+	// invalidate any old header (and the MicroDrive gap) before the copy.
+	if (!write_zeros(out, 0, first) || fsync(out) < 0) {
+		warn("%s", output);
+		close_sources(sources);
+		close(out);
+		return EX_IOERR;
+	}
+
+	std::atomic<unsigned> next(0);
+	std::atomic<bool> failed(false);
+	unsigned count = std::min<unsigned>(std::max(std::thread::hardware_concurrency(), 4u), sources.size());
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < count; ++t) {
+		threads.emplace_back([&](){
+			for (;;) {
+				unsigned i = next++;
+				if (i >= sources.size() || failed) break;
+
+				const source &s = sources[i];
+				if (!copy_range(s.fd, s.offset, out, parts[i].start, s.size)) {
+					warn("%s", s.path);
+					failed = true;
+				}
+			}
+		});
+	}
+	for (auto &t : threads) t.join();
+	close_sources(sources);
+
+	if (failed || fsync(out) < 0) {
+		close(out);
+		return EX_IOERR;
+	}
+
+	if (pwrite(out, header.data(), header.size(), 0) != (ssize_t)header.size() || fsync(out) < 0) {
+		warn("%s", output);
+		close(out);
+		return EX_IOERR;
+	}
+	close(out);
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (options.verbose)
+			printf("%zu: %-20s %8llu %8llu\n", i + 1, parts[i].name.c_str(),
+				(unsigned long long)parts[i].start / 512, (unsigned long long)parts[i].size / 512);
+	}
+	printf("%s: %s image, %zu partitions, %llu blocks\n", output, kind, parts.size(), (unsigned long long)total / 512);
+	return EX_OK;
+}
@@ -0,0 +1,738 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "cache.h"
+#include "chd.h"
+#include "governor.h"
+#include "io.h"
+
+
+namespace {
+
+const uint32_t cache_magic = 0x49495043; // 'IIPC'
+const uint32_t cache_version = 3;
+
+// a unit is the amount cached per slot.
+const uint32_t unit_size = 4096;
+const uint32_t ways = 8;
+
+// longest run of misses loaded with a single preadv.
+const unsigned max_run = 64;
+
+const unsigned max_shards = 64;
+
+struct cache_header
+{
+	std::atomic<uint32_t> magic; // stored last by the creator
+	uint32_t version;
+	uint32_t unit_size;
+	uint32_t ways;
+	uint64_t sets; // per shard
+	uint64_t device_size;
+	uint32_t shards;
+	// processes mapping a shared segment; the last one out unlinks it.
+	std::atomic<uint32_t> attached;
+};
+
+// units are spread across shards by unit number. each shard has its own
+// sets, lock, replacement state and counters, so threads working on
+// different units don't share cache lines.
+struct alignas(128) cache_shard
+{
+	pthread_mutex_t lock;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+};
+
+struct cache_slot
+{
+	// odd while the slot is being loaded or invalidated.
+	std::atomic<uint32_t> seq;
+	// second chance bit for replacement.
+	std::atomic<uint32_t> ref;
+	// unit number + 1; 0 if empty.
+	std::atomic<uint64_t> tag;
+	// pid of the process loading the slot.
+	std::atomic<int32_t> loader;
+	uint32_t reserved;
+};
+
+struct cache_layout
+{
+	size_t shards;
+	size_t hands;
+	size_t slots;
+	size_t data;
+	size_t total;
+};
+
+cache_header *header = nullptr;
+cache_shard *shards;
+uint8_t *hands;
+cache_slot *slots;
+unsigned char *data;
+uint64_t sets; // per shard
+unsigned nshards;
+off_t device_size;
+size_t mapping_size;
+bool shared;
+std::string shm_path; // of a shared segment
+
+// a private cache under -omemory gives up ways from the top of every set:
+// claim only uses the first active_ways(), the rest are emptied.
+governed *memory = nullptr;
+
+size_t round_up(size_t value, size_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+cache_layout layout(uint64_t sets, unsigned nshards)
+{
+	cache_layout l;
+	uint64_t total_sets = sets * nshards;
+
+	l.shards = round_up(sizeof(cache_header), alignof(cache_shard));
+	l.hands = round_up(l.shards + nshards * sizeof(cache_shard), 64);
+	l.slots = round_up(l.hands + total_sets, 64);
+	l.data = round_up(l.slots + total_sets * ways * sizeof(cache_slot), 4096);
+	l.total = l.data + total_sets * ways * unit_size;
+	return l;
+}
+
+void map_layout(void *base)
+{
+	cache_layout l = layout(sets, nshards);
+
+	header = (cache_header *)base;
+	shards = (cache_shard *)((unsigned char *)base + l.shards);
+	hands = (uint8_t *)base + l.hands;
+	slots = (cache_slot *)((unsigned char *)base + l.slots);
+	data = (unsigned char *)base + l.data;
+}
+
+void init_header(uint64_t device_size)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	#ifdef __linux__
+	// a process killed while holding the lock must not wedge the others.
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	#endif
+	for (unsigned i = 0; i < nshards; ++i)
+		pthread_mutex_init(&shards[i].lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	header->version = cache_version;
+	header->unit_size = unit_size;
+	header->ways = ways;
+	header->sets = sets;
+	header->device_size = device_size;
+	header->shards = nshards;
+	header->attached.store(1);
+	header->magic.store(cache_magic, std::memory_order_release);
+}
+
+void lock(cache_shard &shard)
+{
+	int ok = pthread_mutex_lock(&shard.lock);
+	#ifdef __linux__
+	if (ok == EOWNERDEAD) pthread_mutex_consistent(&shard.lock);
+	#else
+	(void)ok;
+	#endif
+}
+
+void unlock(cache_shard &shard)
+{
+	pthread_mutex_unlock(&shard.lock);
+}
+
+cache_shard &shard_of(uint64_t unit)
+{
+	return shards[unit % nshards];
+}
+
+// index of the unit's set among all sets; each shard's sets are contiguous.
+uint64_t set_of(uint64_t unit)
+{
+	uint64_t key = unit / nshards;
+	return (unit % nshards) * sets + ((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) % sets;
+}
+
+cache_shard &shard_of(const cache_slot &s)
+{
+	return shards[(uint64_t)(&s - slots) / ways / sets];
+}
+
+unsigned char *slot_data(const cache_slot &s)
+{
+	return data + (size_t)(&s - slots) * unit_size;
+}
+
+// seqlock writer side. only the owner of an odd slot may touch its contents.
+void begin_write(cache_slot &s)
+{
+	s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void end_write(cache_slot &s)
+{
+	// seq_cst pairs with invalidate_slot retracting the tag of a slot in flight.
+	s.seq.store(s.seq.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+}
+
+bool loader_alive(const cache_slot &s)
+{
+	pid_t pid = s.loader.load(std::memory_order_relaxed);
+	return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// wait for an odd slot to become even (or change hands).
+// returns false if it takes unreasonably long.
+bool wait_for(cache_slot &s, uint64_t tag)
+{
+	struct timespec ts = { 0, 50 * 1000 };
+
+	for (unsigned i = 0; ; ++i) {
+		if (!(s.seq.load(std::memory_order_acquire) & 1)) return true;
+		if (s.tag.load(std::memory_order_relaxed) != tag) return true;
+
+		if (i < 64) {
+			sched_yield();
+			continue;
+		}
+
+		if ((i & 255) == 0 && !loader_alive(s)) {
+			// the loading process died; nobody else will finish the job.
+			cache_shard &shard = shard_of(s);
+			lock(shard);
+			if ((s.seq.load(std::memory_order_relaxed) & 1) && !loader_alive(s)) {
+				s.tag.store(0, std::memory_order_relaxed);
+				end_write(s);
+			}
+			unlock(shard);
+			return true;
+		}
+
+		// ~2 seconds.
+		if (i > 40000) return false;
+		nanosleep(&ts, nullptr);
+	}
+}
+
+enum {
+	LOOKUP_HIT,
+	LOOKUP_MISS,
+	LOOKUP_BUSY,
+};
+
+int lookup(uint64_t unit, char *dest, size_t skip, size_t length, cache_slot **busy)
+{
+	const uint64_t tag = unit + 1;
+	cache_slot *set = slots + set_of(unit) * ways;
+
+	for (unsigned i = 0; i < ways; ++i) {
+		cache_slot &s = set[i];
+		for (;;) {
+			uint32_t seq = s.seq.load(std::memory_order_seq_cst);
+			if (s.tag.load(std::memory_order_seq_cst) != tag) break;
+			if (seq & 1) {
+				*busy = &s;
+				return LOOKUP_BUSY;
+			}
+
+			memcpy(dest, slot_data(s) + skip, length);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) != seq) continue;
+
+			if (!s.ref.load(std::memory_order_relaxed))
+				s.ref.store(1, std::memory_order_relaxed);
+			return LOOKUP_HIT;
+		}
+	}
+	return LOOKUP_MISS;
+}
+
+unsigned active_ways()
+{
+	if (!memory) return ways;
+	size_t w = (ways * memory->limit.load(std::memory_order_relaxed) + memory->size - 1) / memory->size;
+	return std::max<size_t>(std::min<size_t>(w, ways), 1);
+}
+
+// pick a victim in the unit's set and mark it as loading.
+// returns nullptr (and sets *busy) if someone beat us to it, or nullptr
+// (without *busy) if every slot in the set is busy.
+cache_slot *claim(uint64_t unit, cache_slot **busy)
+{
+	const uint64_t tag = unit + 1;
+	const uint64_t set_index = set_of(unit);
+	cache_slot *set = slots + set_index * ways;
+	cache_slot *victim = nullptr;
+	cache_shard &shard = shard_of(unit);
+
+	lock(shard);
+	for (unsigned i = 0; i < ways; ++i) {
+		if (set[i].tag.load(std::memory_order_relaxed) == tag) {
+			unlock(shard);
+			*busy = &set[i];
+			return nullptr;
+		}
+	}
+
+	unsigned active = active_ways();
+	unsigned hand = hands[set_index] % active;
+	for (unsigned n = 0; n < active * 2; ++n) {
+		cache_slot &s = set[(hand + n) % active];
+		if (s.seq.load(std::memory_order_relaxed) & 1) continue;
+		if (s.ref.load(std::memory_order_relaxed)) {
+			s.ref.store(0, std::memory_order_relaxed);
+			continue;
+		}
+		victim = &s;
+		hands[set_index] = (hand + n + 1) % active;
+		break;
+	}
+
+	if (victim) {
+		begin_write(*victim);
+		victim->tag.store(tag, std::memory_order_relaxed);
+		victim->loader.store(getpid(), std::memory_order_relaxed);
+	}
+	unlock(shard);
+	return victim;
+}
+
+void release(cache_slot &s, bool ok)
+{
+	if (!ok) s.tag.store(0, std::memory_order_relaxed);
+	end_write(s);
+}
+
+// caller holds the shard lock, so nobody can claim the slot underneath us.
+void invalidate_slot(cache_slot &s)
+{
+	if (!s.tag.load(std::memory_order_seq_cst)) return;
+
+	uint32_t seq = s.seq.load(std::memory_order_seq_cst);
+	if (seq & 1) {
+		// a load is in flight and may have read the old contents.
+		// let it finish, but retract the tag so it's never published.
+		s.tag.store(0, std::memory_order_seq_cst);
+		if (s.seq.load(std::memory_order_seq_cst) == seq) return;
+		// released in the meantime; readers may have seen it, so bump it below.
+	}
+
+	begin_write(s);
+	s.tag.store(0, std::memory_order_relaxed);
+	end_write(s);
+}
+
+// the governor moved the limit: empty the ways no longer in use and give
+// their memory back. a load in flight there is never published, but it is
+// still reading its slot (load_run copies out of it before release), so its
+// pages are only dropped once it's done; one that takes too long is left to
+// the next resize.
+void resize_cache()
+{
+	#ifdef MADV_REMOVE
+	const int advice = MADV_REMOVE; // the private cache is shared anonymous memory
+	#else
+	const int advice = MADV_DONTNEED;
+	#endif
+
+	unsigned active = active_ways();
+	memory->used.store(memory->size / ways * active, std::memory_order_relaxed);
+	if (active == ways) return;
+
+	for (unsigned n = 0; n < nshards; ++n) {
+		lock(shards[n]);
+		for (uint64_t set = n * sets; set < (n + 1) * sets; ++set) {
+			cache_slot *base = slots + set * ways;
+			for (unsigned i = active; i < ways; ++i) invalidate_slot(base[i]);
+		}
+		unlock(shards[n]);
+	}
+
+	// loads finish without the lock.
+	for (uint64_t i = 0; i < sets * nshards * ways; ++i) {
+		if (i % ways >= active) wait_for(slots[i], 0);
+	}
+
+	// only empty, idle slots: the limit may have grown again meanwhile, and
+	// claims (which need the lock) can't start on them while it's held.
+	for (unsigned n = 0; n < nshards; ++n) {
+		lock(shards[n]);
+		unsigned now_active = active_ways();
+		for (uint64_t set = n * sets; set < (n + 1) * sets; ++set) {
+			cache_slot *base = slots + set * ways;
+			for (unsigned i = now_active; i < ways; ) {
+				unsigned j = i;
+				while (j < ways && !base[j].tag.load(std::memory_order_relaxed)
+					&& !(base[j].seq.load(std::memory_order_acquire) & 1)) ++j;
+				if (j > i) madvise(slot_data(base[i]), (j - i) * unit_size, advice);
+				i = j + 1;
+			}
+		}
+		unlock(shards[n]);
+	}
+}
+
+struct miss_run
+{
+	uint64_t first = 0;
+	unsigned count = 0;
+	cache_slot *slots[max_run];
+};
+
+// where unit's portion of a request [offset, offset + size) lives.
+struct unit_span
+{
+	size_t skip;
+	size_t length;
+	size_t out;
+};
+
+unit_span span_of(uint64_t unit, off_t offset, size_t size)
+{
+	unit_span sp;
+	off_t start = (off_t)unit * unit_size;
+	off_t begin = std::max(offset, start);
+	off_t end = std::min(offset + (off_t)size, start + (off_t)unit_size);
+
+	sp.skip = begin - start;
+	sp.length = end - begin;
+	sp.out = begin - offset;
+	return sp;
+}
+
+ssize_t direct(int fd, char *out, off_t offset, size_t size, uint64_t unit)
+{
+	unit_span sp = span_of(unit, offset, size);
+	ssize_t ok = device_pread(fd, out + sp.out, sp.length, (off_t)unit * unit_size + sp.skip);
+	if (ok < 0) return -1;
+	if ((size_t)ok < sp.length) memset(out + sp.out + ok, 0, sp.length - ok);
+	return 0;
+}
+
+// load a run of claimed slots with one read, then copy out and publish them.
+ssize_t load_run(int fd, const miss_run &run, char *out, off_t offset, size_t size)
+{
+	struct iovec iov[max_run];
+
+	for (unsigned i = 0; i < run.count; ++i) {
+		iov[i].iov_base = slot_data(*run.slots[i]);
+		iov[i].iov_len = unit_size;
+	}
+
+	ssize_t ok = device_preadv(fd, iov, run.count, (off_t)run.first * unit_size);
+	int error = errno;
+
+	for (unsigned i = 0; i < run.count; ++i) {
+		cache_slot &s = *run.slots[i];
+		uint64_t unit = run.first + i;
+		off_t start = (off_t)unit * unit_size;
+		size_t expected = std::min((off_t)unit_size, device_size - start);
+		ssize_t have = ok < 0 ? 0 : std::min(std::max(ok - (ssize_t)i * (ssize_t)unit_size, (ssize_t)0), (ssize_t)unit_size);
+
+		if (have < (ssize_t)expected) {
+			// short read in the middle of the device; don't cache it.
+			release(s, false);
+			if (ok < 0) continue;
+			if (direct(fd, out, offset, size, unit) < 0) {
+				ok = -1;
+				error = errno;
+			}
+			continue;
+		}
+		if (have < (ssize_t)unit_size)
+			memset(slot_data(s) + have, 0, unit_size - have);
+
+		unit_span sp = span_of(unit, offset, size);
+		memcpy(out + sp.out, slot_data(s) + sp.skip, sp.length);
+		release(s, true);
+	}
+
+	if (ok < 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+// at exit. a mount attaching just as the count reaches 0 keeps working on
+// the unlinked segment; the next one makes a new segment.
+void detach()
+{
+	if (header->attached.fetch_sub(1) == 1) shm_unlink(shm_path.c_str());
+}
+
+// runs don't overlap, so they load side by side; the batch collects them.
+void flush_run(io_batch &batch, int fd, miss_run &run, char *out, off_t offset, size_t size)
+{
+	if (!run.count) return;
+
+	batch.add([=]{ return load_run(fd, run, out, offset, size) == 0; });
+	run.count = 0;
+}
+
+} // namespace
+
+
+bool cache_init(off_t size, size_t bytes, const char *shm_name)
+{
+	// one shard per core (rounded up to a power of 2), but every shard
+	// needs at least one set.
+	unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+	nshards = 1;
+	while (nshards < cores && nshards < max_shards) nshards <<= 1;
+
+	uint64_t nsets = bytes / unit_size / ways;
+	while (nshards > 1 && nsets < nshards) nshards >>= 1;
+
+	sets = std::max(nsets / nshards, (uint64_t)1);
+	device_size = size;
+	shared = false;
+
+	cache_layout l = layout(sets, nshards);
+	void *base = MAP_FAILED;
+	bool creator = true;
+
+	if (shm_name) {
+		int sfd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (sfd < 0 && errno == EEXIST) {
+			creator = false;
+			sfd = shm_open(shm_name, O_RDWR, 0);
+		}
+		if (sfd < 0) {
+			warn("shm_open %s", shm_name);
+			return false;
+		}
+
+		if (creator) {
+			if (ftruncate(sfd, l.total) < 0) {
+				warn("ftruncate %s", shm_name);
+				close(sfd);
+				shm_unlink(shm_name);
+				return false;
+			}
+		} else {
+			// the creator may not have sized it yet.
+			struct stat st;
+			for (int i = 0; ; ++i) {
+				if (fstat(sfd, &st) < 0 || i == 1000) {
+					warnx("%s: segment never initialized", shm_name);
+					close(sfd);
+					return false;
+				}
+				if (st.st_size >= (off_t)sizeof(cache_header)) break;
+				usleep(1000);
+			}
+			l.total = st.st_size;
+		}
+
+		base = mmap(nullptr, l.total, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+		close(sfd);
+		if (base == MAP_FAILED) {
+			warn("mmap %s", shm_name);
+			return false;
+		}
+		shared = true;
+	} else {
+		base = mmap(nullptr, l.total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+		if (base == MAP_FAILED) {
+			warn("mmap");
+			return false;
+		}
+	}
+	mapping_size = l.total;
+
+	if (creator) {
+		map_layout(base);
+		init_header(size);
+		if (shared) {
+			shm_path = shm_name;
+			atexit(detach);
+		} else {
+			memory = new governed("cache", sets * nshards * ways * unit_size, resize_cache);
+			memory->used = memory->size;
+			governor_add(*memory);
+		}
+		return true;
+	}
+
+	// attach to an existing segment, using its geometry.
+	cache_header *h = (cache_header *)base;
+	for (int i = 0; h->magic.load(std::memory_order_acquire) != cache_magic; ++i) {
+		if (i == 1000) {
+			warnx("%s: segment never initialized", shm_name);
+			munmap(base, l.total);
+			return false;
+		}
+		usleep(1000);
+	}
+
+	if (h->version != cache_version || h->unit_size != unit_size || h->ways != ways
+		|| h->device_size != (uint64_t)size || !h->shards || h->shards > max_shards
+		|| layout(h->sets, h->shards).total > l.total) {
+		warnx("%s: incompatible cache segment", shm_name);
+		munmap(base, l.total);
+		return false;
+	}
+
+	sets = h->sets;
+	nshards = h->shards;
+	map_layout(base);
+	header->attached.fetch_add(1);
+	shm_path = shm_name;
+	atexit(detach);
+	return true;
+}
+
+bool cache_enabled()
+{
+	return header != nullptr;
+}
+
+ssize_t cache_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	if (!header) return device_pread(fd, buf, size, offset);
+
+	if (offset >= device_size || size == 0) return 0;
+	if (offset + (off_t)size > device_size) size = device_size - offset;
+
+	char *out = (char *)buf;
+	uint64_t first = offset / unit_size;
+	uint64_t last = (offset + size - 1) / unit_size;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	miss_run run;
+	io_batch batch;
+
+	for (uint64_t unit = first; unit <= last; ++unit) {
+		unit_span sp = span_of(unit, offset, size);
+
+		for (;;) {
+			cache_slot *busy = nullptr;
+			int rv = lookup(unit, out + sp.out, sp.skip, sp.length, &busy);
+
+			if (rv == LOOKUP_HIT) {
+				++hits;
+				break;
+			}
+
+			if (rv == LOOKUP_MISS) {
+				cache_slot *s = claim(unit, &busy);
+				if (s) {
+					++misses;
+					if (run.count == max_run || (run.count && run.first + run.count != unit))
+						flush_run(batch, fd, run, out, offset, size);
+					if (!run.count) run.first = unit;
+					run.slots[run.count++] = s;
+					break;
+				}
+				if (!busy) {
+					// the whole set is being loaded; go around the cache.
+					++misses;
+					if (direct(fd, out, offset, size, unit) < 0) {
+						int error = errno;
+						flush_run(batch, fd, run, out, offset, size);
+						batch.wait();
+						errno = error;
+						return -1;
+					}
+					break;
+				}
+			}
+
+			// someone else is loading it. finish our own loads before waiting
+			// so two readers can never end up waiting on each other.
+			flush_run(batch, fd, run, out, offset, size);
+			if (!batch.wait()) return -1;
+			if (!wait_for(*busy, unit + 1)) {
+				++misses;
+				if (direct(fd, out, offset, size, unit) < 0) return -1;
+				break;
+			}
+		}
+	}
+	flush_run(batch, fd, run, out, offset, size);
+	if (!batch.wait()) return -1;
+
+	cache_shard &shard = shard_of(first);
+	if (hits) shard.hits.fetch_add(hits, std::memory_order_relaxed);
+	if (misses) shard.misses.fetch_add(misses, std::memory_order_relaxed);
+	return size;
+}
+
+void cache_invalidate(off_t offset, off_t size)
+{
+	if (!header || size <= 0) return;
+
+	uint64_t first = offset / unit_size;
+	uint64_t last = (offset + size - 1) / unit_size;
+	const uint64_t shard_slots = sets * ways;
+
+	if (last - first + 1 >= shard_slots * nshards) {
+		// cheaper to sweep everything, one shard at a time.
+		for (unsigned n = 0; n < nshards; ++n) {
+			cache_slot *base = slots + n * shard_slots;
+			lock(shards[n]);
+			for (uint64_t i = 0; i < shard_slots; ++i) {
+				uint64_t tag = base[i].tag.load(std::memory_order_relaxed);
+				if (tag > first && tag <= last + 1) invalidate_slot(base[i]);
+			}
+			unlock(shards[n]);
+		}
+		return;
+	}
+
+	for (uint64_t unit = first; unit <= last; ++unit) {
+		cache_slot *set = slots + set_of(unit) * ways;
+		cache_shard &shard = shard_of(unit);
+
+		lock(shard);
+		for (unsigned i = 0; i < ways; ++i) {
+			if (set[i].tag.load(std::memory_order_relaxed) == unit + 1)
+				invalidate_slot(set[i]);
+		}
+		unlock(shard);
+	}
+}
+
+void cache_get_stats(cache_stats &stats)
+{
+	stats = cache_stats();
+	if (!header) return;
+
+	for (unsigned i = 0; i < nshards; ++i) {
+		stats.hits += shards[i].hits.load(std::memory_order_relaxed);
+		stats.misses += shards[i].misses.load(std::memory_order_relaxed);
+	}
+	stats.bytes = sets * nshards * ways * unit_size;
+	stats.shards = nshards;
+	stats.shared = shared;
+}
@@ -0,0 +1,46 @@
+#ifndef cache_h
+#define cache_h
+
+#include <sys/types.h>
+
+#include <cstdint>
+
+/*
+ * Block cache for the backing store.
+ *
+ * The cache lives in a single mapping: either anonymous memory (private to
+ * this process) or a POSIX shared memory segment that every mount of the
+ * same image attaches to. Lookups are lock-free (each slot is protected by
+ * a sequence counter); only a miss takes a lock, and only long enough to
+ * claim a slot, so exactly one process loads any given unit from the device.
+ * Units are sharded by unit number, one shard per core, each with its own
+ * lock, replacement state and counters.
+ *
+ * A shared segment is counted by the processes attached to it and unlinked
+ * when the last one exits. One left behind by a mount that was killed
+ * outright is /dev/shm/ii-part-* on Linux; remove it by hand.
+ */
+
+struct cache_stats
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t bytes = 0;
+	unsigned shards = 0;
+	bool shared = false;
+};
+
+// bytes is the cache size; shm_name is nullptr for a private cache.
+bool cache_init(off_t device_size, size_t bytes, const char *shm_name);
+
+bool cache_enabled();
+
+// same contract as pread(2).
+ssize_t cache_pread(int fd, void *buf, size_t size, off_t offset);
+
+// drop anything cached in [offset, offset + size).
+void cache_invalidate(off_t offset, off_t size);
+
+void cache_get_stats(cache_stats &stats);
+
+#endif
@@ -0,0 +1,528 @@
+
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ii-part.h"
+#include "prodos.h"
+
+/*
+ * --catalog=INDEX image-or-directory...: index every file in every ProDOS
+ * partition of a set of images.
+ * --catalog=INDEX --find=TERM: look files up by name (exact, or a glob
+ * with * and ?), case-insensitively, or by 16 hex digit content hash.
+ *
+ * The index is a single file meant to be mapped, in native byte order:
+ *
+ *   catalog_header
+ *   catalog_partition[partitions]
+ *   catalog_file[files]             (grouped by partition)
+ *   uint32_t by_name[files]         (sorted by leaf name, ignoring case)
+ *   uint32_t by_hash[files]         (sorted by content hash)
+ *   char strings[strings_size]      (NUL-terminated)
+ *
+ * Rebuilding reuses the entries of an image that is unchanged (same size and
+ * mtime) without reading it. A changed image has every file read again:
+ * a file can be rewritten in place without touching its directory entry or
+ * the bitmap, so nothing cheaper shows whether its content hash still
+ * holds. Images are indexed in parallel by a bounded set of threads.
+ */
+
+namespace {
+
+const char catalog_magic[8] = { 'i', 'i', 'p', 'c', 'a', 't', '1', 0 };
+
+struct catalog_header
+{
+	char magic[8];
+	uint32_t partitions;
+	uint32_t files;
+	uint32_t strings_size;
+	uint32_t reserved[3];
+};
+
+struct catalog_partition
+{
+	uint64_t hash;
+	uint64_t image_size;
+	uint64_t image_mtime;
+	uint32_t image; // string offsets
+	uint32_t name;
+	uint32_t volume;
+	uint32_t first_file;
+	uint32_t file_count;
+	uint32_t reserved;
+};
+
+struct catalog_file
+{
+	uint64_t hash; // of the data fork
+	uint32_t path; // string offset
+	uint32_t partition;
+	uint32_t eof;
+	uint16_t file_type;
+	uint16_t aux_type;
+	uint8_t storage_type;
+	uint8_t reserved[7];
+};
+
+static_assert(sizeof(catalog_header) == 32, "catalog_header");
+static_assert(sizeof(catalog_partition) == 48, "catalog_partition");
+static_assert(sizeof(catalog_file) == 32, "catalog_file");
+
+
+// a mapped index.
+struct catalog
+{
+	void *base = MAP_FAILED;
+	size_t size = 0;
+
+	const catalog_header *header = nullptr;
+	const catalog_partition *partitions = nullptr;
+	const catalog_file *files = nullptr;
+	const uint32_t *by_name = nullptr;
+	const uint32_t *by_hash = nullptr;
+	const char *strings = nullptr;
+
+	~catalog()
+	{
+		if (base != MAP_FAILED) munmap(base, size);
+	}
+
+	bool open(const char *path)
+	{
+		struct stat st;
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(catalog_header)) {
+			close(fd);
+			errno = EINVAL;
+			return false;
+		}
+		size = st.st_size;
+		base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) return false;
+
+		const char *cp = (const char *)base;
+		header = (const catalog_header *)cp;
+		if (memcmp(header->magic, catalog_magic, 8)) {
+			errno = EINVAL;
+			return false;
+		}
+
+		size_t need = sizeof(catalog_header)
+			+ (size_t)header->partitions * sizeof(catalog_partition)
+			+ (size_t)header->files * (sizeof(catalog_file) + 8)
+			+ header->strings_size;
+		if (need != size || !header->strings_size || cp[size - 1]) {
+			errno = EINVAL;
+			return false;
+		}
+
+		cp += sizeof(catalog_header);
+		partitions = (const catalog_partition *)cp;
+		cp += header->partitions * sizeof(catalog_partition);
+		files = (const catalog_file *)cp;
+		cp += header->files * sizeof(catalog_file);
+		by_name = (const uint32_t *)cp;
+		cp += header->files * 4;
+		by_hash = (const uint32_t *)cp;
+		cp += header->files * 4;
+		strings = cp;
+		return true;
+	}
+
+	const char *string(uint32_t offset) const
+	{
+		return offset < header->strings_size ? strings + offset : "";
+	}
+};
+
+const char *leaf(const char *path)
+{
+	const char *cp = strrchr(path, '/');
+	return cp ? cp + 1 : path;
+}
+
+
+// one partition's worth of entries while building.
+struct file_record
+{
+	uint64_t hash;
+	std::string path;
+	uint32_t eof;
+	uint16_t file_type;
+	uint16_t aux_type;
+	uint8_t storage_type;
+};
+
+struct partition_record
+{
+	uint64_t hash = 0;
+	uint64_t image_size = 0;
+	uint64_t image_mtime = 0;
+	std::string image;
+	std::string name;
+	std::string volume;
+	std::vector<file_record> files;
+};
+
+void load_records(const catalog &c, std::vector<partition_record> &out)
+{
+	for (uint32_t i = 0; i < c.header->partitions; ++i) {
+		const catalog_partition &p = c.partitions[i];
+		partition_record r;
+		r.hash = p.hash;
+		r.image_size = p.image_size;
+		r.image_mtime = p.image_mtime;
+		r.image = c.string(p.image);
+		r.name = c.string(p.name);
+		r.volume = c.string(p.volume);
+		for (uint32_t j = p.first_file; j < p.first_file + p.file_count && j < c.header->files; ++j) {
+			const catalog_file &f = c.files[j];
+			r.files.push_back({ f.hash, c.string(f.path), f.eof, f.file_type, f.aux_type, f.storage_type });
+		}
+		out.push_back(std::move(r));
+	}
+}
+
+// bitmap and directory blocks: a fingerprint of the volume's layout, stored
+// with the partition. it misses files rewritten in place, so it isn't a
+// reason to skip reading them.
+bool partition_hash(const prodos_volume &v, const std::vector<prodos_file> &list, uint64_t &hash)
+{
+	std::vector<unsigned char> data(v.bitmap_blocks() * 512);
+	std::vector<unsigned> blocks;
+	unsigned char block[512];
+
+	if (!v.read(v.bitmap_pointer, v.bitmap_blocks(), data.data())) return false;
+	hash = fnv(data.data(), data.size());
+
+	if (!prodos_directory_blocks(v, 2, blocks)) return false;
+	for (const auto &f : list) {
+		if (f.entry.storage_type != STORAGE_SUBDIR) continue;
+		std::vector<unsigned> tmp;
+		if (!prodos_directory_blocks(v, f.entry.key_pointer, tmp)) return false;
+		blocks.insert(blocks.end(), tmp.begin(), tmp.end());
+	}
+	for (unsigned b : blocks) {
+		if (!v.read(b, 1, block)) return false;
+		hash = fnv(block, 512, hash);
+	}
+	return true;
+}
+
+// the partitions of an image (or the image itself, if it's a bare volume).
+bool image_partitions(int fd, off_t size, std::vector<file_info> &parts)
+{
+	unsigned char buffer[512 * FOCUS_HEADER_BLOCKS];
+	if (pread(fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) return false;
+
+	if (is_focus(buffer) || is_zip(buffer)) parse_focus(buffer, parts);
+	else if (is_microdrive(buffer)) parse_microdrive(buffer, parts);
+	else {
+		file_info f;
+		f.name = "";
+		f.start = 0;
+		f.size = size;
+		parts.push_back(std::move(f));
+	}
+	return true;
+}
+
+void index_image(const std::string &path, const std::multimap<std::string, const partition_record *> &old, std::vector<partition_record> &out)
+{
+	struct stat st;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		warn("%s", path.c_str());
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	// unchanged image: reuse everything.
+	auto range = old.equal_range(path);
+	if (range.first != range.second && range.first->second->image_size == (uint64_t)st.st_size && range.first->second->image_mtime == mtime_ns(st)) {
+		for (auto iter = range.first; iter != range.second; ++iter)
+			out.push_back(*iter->second);
+		close(fd);
+		return;
+	}
+
+	std::vector<file_info> parts;
+	if (!image_partitions(fd, st.st_size, parts)) {
+		close(fd);
+		return;
+	}
+
+	std::vector<unsigned char> data;
+	for (const auto &part : parts) {
+		prodos_volume v;
+		std::vector<prodos_file> list;
+		partition_record r;
+
+		if (part.start + part.size > st.st_size) continue;
+		if (!v.open(fd, part)) continue;
+		if (!prodos_list(v, list) || !partition_hash(v, list, r.hash)) {
+			warnx("%s %s: unreadable", path.c_str(), part.name.c_str());
+			continue;
+		}
+
+		r.image = path;
+		r.image_size = st.st_size;
+		r.image_mtime = mtime_ns(st);
+		r.name = part.name;
+		r.volume = v.name;
+
+		for (const auto &f : list) {
+			const prodos_entry &e = f.entry;
+			file_record fr = { 0, "/" + v.name + f.path, e.eof, (uint16_t)e.file_type, (uint16_t)e.aux_type, (uint8_t)e.storage_type };
+
+			unsigned storage_type = e.storage_type;
+			unsigned key = e.key_pointer;
+			uint32_t eof = e.eof;
+			if (e.storage_type == STORAGE_EXTENDED) {
+				// the data fork's mini entry.
+				unsigned char block[512];
+				if (!v.read(e.key_pointer, 1, block)) continue;
+				storage_type = block[0];
+				key = read16(block + 1);
+				eof = read24(block + 5);
+			}
+			if (storage_type >= STORAGE_SEEDLING && storage_type <= STORAGE_TREE && prodos_read_fork(v, storage_type, key, eof, data))
+				fr.hash = fnv(data.data(), data.size());
+			r.files.push_back(std::move(fr));
+		}
+		out.push_back(std::move(r));
+	}
+	close(fd);
+}
+
+struct string_table
+{
+	std::string data;
+	std::unordered_map<std::string, uint32_t> known;
+
+	uint32_t add(const std::string &s)
+	{
+		auto iter = known.find(s);
+		if (iter != known.end()) return iter->second;
+		uint32_t offset = data.size();
+		data.append(s);
+		data.push_back(0);
+		known.emplace(s, offset);
+		return offset;
+	}
+};
+
+bool write_catalog(const char *path, const std::vector<partition_record> &records)
+{
+	std::vector<catalog_partition> partitions;
+	std::vector<catalog_file> files;
+	std::vector<const char *> names; // leaf names, for sorting
+	string_table strings;
+
+	strings.add("");
+	for (const auto &r : records) {
+		catalog_partition p = {};
+		p.hash = r.hash;
+		p.image_size = r.image_size;
+		p.image_mtime = r.image_mtime;
+		p.image = strings.add(r.image);
+		p.name = strings.add(r.name);
+		p.volume = strings.add(r.volume);
+		p.first_file = files.size();
+		p.file_count = r.files.size();
+		for (const auto &fr : r.files) {
+			catalog_file f = {};
+			f.hash = fr.hash;
+			f.path = strings.add(fr.path);
+			f.partition = partitions.size();
+			f.eof = fr.eof;
+			f.file_type = fr.file_type;
+			f.aux_type = fr.aux_type;
+			f.storage_type = fr.storage_type;
+			files.push_back(f);
+		}
+		partitions.push_back(p);
+	}
+
+	std::vector<uint32_t> by_name(files.size()), by_hash(files.size());
+	for (uint32_t i = 0; i < files.size(); ++i) by_name[i] = by_hash[i] = i;
+
+	const char *s = strings.data.data();
+	std::sort(by_name.begin(), by_name.end(), [&](uint32_t a, uint32_t b){
+		return strcasecmp(leaf(s + files[a].path), leaf(s + files[b].path)) < 0;
+	});
+	std::sort(by_hash.begin(), by_hash.end(), [&](uint32_t a, uint32_t b){
+		return files[a].hash < files[b].hash;
+	});
+
+	catalog_header h = {};
+	memcpy(h.magic, catalog_magic, 8);
+	h.partitions = partitions.size();
+	h.files = files.size();
+	h.strings_size = strings.data.size();
+
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp) return false;
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(partitions.data(), sizeof(catalog_partition), partitions.size(), fp);
+	fwrite(files.data(), sizeof(catalog_file), files.size(), fp);
+	fwrite(by_name.data(), 4, by_name.size(), fp);
+	fwrite(by_hash.data(), 4, by_hash.size(), fp);
+	fwrite(strings.data.data(), 1, strings.data.size(), fp);
+	if (ferror(fp) | fclose(fp)) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return rename(tmp.c_str(), path) == 0;
+}
+
+void print_file(const catalog &c, uint32_t index)
+{
+	const catalog_file &f = c.files[index];
+	const catalog_partition &p = c.partitions[f.partition];
+	printf("%016llx  %s  %s  %s  $%02x/$%04x  %u\n", (unsigned long long)f.hash,
+		c.string(p.image), *c.string(p.name) ? c.string(p.name) : "-",
+		c.string(f.path), f.file_type, f.aux_type, f.eof);
+}
+
+// for equal_range, which compares index entries with the search key both ways.
+uint64_t key_hash(const catalog &c, uint32_t index) { return c.files[index].hash; }
+uint64_t key_hash(const catalog &, uint64_t hash) { return hash; }
+const char *key_name(const catalog &c, uint32_t index) { return leaf(c.string(c.files[index].path)); }
+const char *key_name(const catalog &, const char *name) { return name; }
+
+bool is_hash(const char *term, uint64_t &hash)
+{
+	if (strlen(term) != 16) return false;
+	char *ep;
+	hash = strtoull(term, &ep, 16);
+	return *ep == 0;
+}
+
+} // namespace
+
+
+int catalog_build(const char *index, const std::vector<const char *> &inputs)
+{
+	std::vector<std::string> paths;
+	struct stat st;
+
+	for (const char *in : inputs) {
+		if (stat(in, &st) == 0 && S_ISDIR(st.st_mode)) {
+			DIR *dp = opendir(in);
+			if (!dp) {
+				warn("%s", in);
+				continue;
+			}
+			while (struct dirent *d = readdir(dp)) {
+				if (d->d_name[0] == '.') continue;
+				std::string path = std::string(in) + "/" + d->d_name;
+				if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) paths.push_back(path);
+			}
+			closedir(dp);
+		} else paths.push_back(in);
+	}
+	std::sort(paths.begin(), paths.end());
+
+	// the old index, for incremental updates.
+	std::vector<partition_record> previous;
+	{
+		catalog c;
+		if (c.open(index)) load_records(c, previous);
+	}
+	std::multimap<std::string, const partition_record *> old;
+	for (const auto &r : previous) old.emplace(r.image, &r);
+
+	std::vector<std::vector<partition_record>> results(paths.size());
+	std::atomic<unsigned> next(0);
+
+	// i/o bound; a few threads even on small machines, but not hundreds.
+	unsigned count = std::max(std::thread::hardware_concurrency(), 4u);
+	count = std::min(count, std::max(options.jobs, 1u));
+	count = std::min(count, (unsigned)paths.size());
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < count; ++i) {
+		threads.emplace_back([&](){
+			for (;;) {
+				unsigned index = next++;
+				if (index >= paths.size()) break;
+				index_image(paths[index], old, results[index]);
+			}
+		});
+	}
+	for (auto &t : threads) t.join();
+
+	std::vector<partition_record> records;
+	size_t files = 0;
+	for (auto &v : results) {
+		for (auto &r : v) {
+			files += r.files.size();
+			records.push_back(std::move(r));
+		}
+	}
+
+	if (!write_catalog(index, records)) {
+		warn("%s", index);
+		return EX_CANTCREAT;
+	}
+	printf("%s: %zu images, %zu partitions, %zu files\n", index, paths.size(), records.size(), files);
+	return EX_OK;
+}
+
+int catalog_find(const char *index, const char *term)
+{
+	catalog c;
+	uint64_t hash;
+	unsigned found = 0;
+
+	if (!c.open(index)) {
+		warn("%s", index);
+		return EX_NOINPUT;
+	}
+	const catalog_header &h = *c.header;
+
+	if (is_hash(term, hash)) {
+		auto range = std::equal_range(c.by_hash, c.by_hash + h.files, hash, [&](const auto &a, const auto &b){
+			return key_hash(c, a) < key_hash(c, b);
+		});
+		for (auto iter = range.first; iter != range.second; ++iter, ++found)
+			print_file(c, *iter);
+	} else if (strpbrk(term, "*?[")) {
+		for (uint32_t i = 0; i < h.files; ++i) {
+			if (fnmatch(term, leaf(c.string(c.files[i].path)), FNM_CASEFOLD) == 0) {
+				print_file(c, i);
+				++found;
+			}
+		}
+	} else {
+		auto range = std::equal_range(c.by_name, c.by_name + h.files, term, [&](const auto &a, const auto &b){
+			return strcasecmp(key_name(c, a), key_name(c, b)) < 0;
+		});
+		for (auto iter = range.first; iter != range.second; ++iter, ++found)
+			print_file(c, *iter);
+	}
+	return found ? EX_OK : 1;
+}
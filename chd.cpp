@@ -0,0 +1,792 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <lzma.h>
+#include <zlib.h>
+
+#include "chd.h"
+#include "governor.h"
+#include "ii-part.h"
+
+/*
+ * CHD v5, as written by chdman createhd/createraw.
+ *
+ * The header names up to four codecs; each hunk in the map is either
+ * compressed with one of them, stored, a copy of an earlier hunk (self), or
+ * a reference into the parent CHD (for a diff image). The compressed map is
+ * a huffman-coded list of hunk types followed by their lengths, offsets and
+ * CRC16s, decoded once at open.
+ *
+ * zlib, lzma and huff hunks are supported; flac hunks (which chdman only
+ * picks for audio-like data) read as an I/O error.
+ *
+ * Decompressed hunks are kept in an LRU. Reads spanning several hunks, and
+ * the hunks following a sequential read, are decompressed in parallel by a
+ * few worker threads.
+ */
+
+namespace {
+
+enum {
+	COMPRESSION_TYPE_0 = 0,
+	COMPRESSION_TYPE_1 = 1,
+	COMPRESSION_TYPE_2 = 2,
+	COMPRESSION_TYPE_3 = 3,
+	COMPRESSION_NONE = 4,
+	COMPRESSION_SELF = 5,
+	COMPRESSION_PARENT = 6,
+	COMPRESSION_RLE_SMALL = 7,
+	COMPRESSION_RLE_LARGE = 8,
+	COMPRESSION_SELF_0 = 9,
+	COMPRESSION_SELF_1 = 10,
+	COMPRESSION_PARENT_SELF = 11,
+	COMPRESSION_PARENT_0 = 12,
+	COMPRESSION_PARENT_1 = 13,
+
+	COMPRESSION_ZERO = 0xff, // not in an uncompressed map, and no parent
+};
+
+constexpr uint32_t fourcc(const char *s)
+{
+	return (uint32_t)s[0] << 24 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 8 | (uint32_t)s[3];
+}
+
+const uint32_t CODEC_ZLIB = fourcc("zlib");
+const uint32_t CODEC_LZMA = fourcc("lzma");
+const uint32_t CODEC_HUFF = fourcc("huff");
+
+const unsigned header_size = 124;
+const size_t hunk_cache_limit = 32 << 20;
+const unsigned read_ahead = 8; // hunks
+const unsigned max_queue = 64;
+
+struct map_entry
+{
+	uint8_t type;
+	bool has_crc;
+	uint16_t crc;
+	uint32_t length;
+	uint64_t offset; // bytes; hunks for self; units for parent
+};
+
+struct chd_file
+{
+	int fd = -1;
+	unsigned level = 0; // 0 is the image; its parent is 1.
+	uint32_t codecs[4];
+	uint64_t logical_size;
+	uint32_t hunk_bytes;
+	uint32_t unit_bytes;
+	uint32_t hunk_count;
+	uint64_t map_offset;
+	unsigned char sha1[20];
+	unsigned char parent_sha1[20];
+	std::vector<map_entry> map;
+	std::unique_ptr<chd_file> parent;
+
+	std::atomic<uint64_t> next_offset{ ~UINT64_C(0) }; // to spot sequential reads
+};
+
+chd_file *top = nullptr; // never destroyed, like the cache
+std::atomic<bool> workers_running{ false };
+
+
+uint64_t be(const unsigned char *p, unsigned n)
+{
+	uint64_t x = 0;
+	while (n--) x = x << 8 | *p++;
+	return x;
+}
+
+void put_be(unsigned char *p, uint64_t x, unsigned n)
+{
+	while (n--) {
+		p[n] = x;
+		x >>= 8;
+	}
+}
+
+// CRC-16/CCITT, as MAME uses for the map and hunks.
+uint16_t crc16(const unsigned char *data, size_t size)
+{
+	static const struct table {
+		uint16_t v[256];
+		table() {
+			for (unsigned i = 0; i < 256; ++i) {
+				uint16_t c = i << 8;
+				for (int j = 0; j < 8; ++j) c = c & 0x8000 ? (c << 1) ^ 0x1021 : c << 1;
+				v[i] = c;
+			}
+		}
+	} t;
+
+	uint16_t crc = 0xffff;
+	for (size_t i = 0; i < size; ++i)
+		crc = (crc << 8) ^ t.v[(crc >> 8) ^ data[i]];
+	return crc;
+}
+
+
+// MSB first; reads past the end return zeros.
+struct bit_reader
+{
+	const unsigned char *data;
+	size_t size;
+	size_t bit = 0;
+
+	bit_reader(const unsigned char *data, size_t size) : data(data), size(size) {}
+
+	uint32_t peek(unsigned n) const
+	{
+		if (!n) return 0;
+		size_t byte = bit >> 3;
+		uint64_t window = 0;
+		for (unsigned i = 0; i < 5; ++i)
+			window = window << 8 | (byte + i < size ? data[byte + i] : 0);
+		return (window << 24 << (bit & 7)) >> (64 - n);
+	}
+
+	void skip(unsigned n) { bit += n; }
+
+	uint64_t read(unsigned n)
+	{
+		uint64_t x = 0;
+		while (n > 24) {
+			x = x << 24 | peek(24);
+			skip(24);
+			n -= 24;
+		}
+		x = x << n | peek(n);
+		skip(n);
+		return x;
+	}
+
+	bool overflow() const { return bit > size * 8; }
+};
+
+// MAME's canonical huffman decoder (lib/util/huffman.cpp).
+struct huffman
+{
+	unsigned max_bits;
+	std::vector<uint8_t> lengths;
+	std::vector<uint32_t> lookup; // symbol << 5 | length
+
+	huffman(unsigned codes, unsigned max_bits) : max_bits(max_bits), lengths(codes, 0) {}
+
+	unsigned decode(bit_reader &in) const
+	{
+		uint32_t v = lookup[in.peek(max_bits)];
+		in.skip(v & 31);
+		return v >> 5;
+	}
+
+	// codes are assigned longest first, each length starting where the longer ones left off.
+	bool assign_codes()
+	{
+		uint32_t start_of[33] = {};
+		for (auto l : lengths) {
+			if (l > max_bits) return false;
+			start_of[l]++;
+		}
+		uint32_t start = 0;
+		for (int len = 32; len > 0; --len) {
+			uint32_t next = (start + start_of[len]) >> 1;
+			if (len != 1 && next * 2 != start + start_of[len]) return false;
+			start_of[len] = start;
+			start = next;
+		}
+
+		lookup.assign(1u << max_bits, 0);
+		for (size_t i = 0; i < lengths.size(); ++i) {
+			unsigned len = lengths[i];
+			if (!len) continue;
+			uint32_t code = start_of[len]++;
+			unsigned shift = max_bits - len;
+			if (((code + 1) << shift) > lookup.size()) return false;
+			std::fill(&lookup[code << shift], &lookup[0] + ((code + 1) << shift), (uint32_t)(i << 5 | len));
+		}
+		return true;
+	}
+
+	// code lengths, run-length encoded (the map).
+	bool import_rle(bit_reader &in)
+	{
+		unsigned width = max_bits >= 16 ? 5 : max_bits >= 8 ? 4 : 3;
+		size_t i = 0;
+		while (i < lengths.size()) {
+			unsigned n = in.read(width);
+			if (n != 1) {
+				lengths[i++] = n;
+				continue;
+			}
+			n = in.read(width);
+			if (n == 1) {
+				lengths[i++] = n;
+				continue;
+			}
+			unsigned count = in.read(width) + 3;
+			while (count-- && i < lengths.size()) lengths[i++] = n;
+		}
+		return !in.overflow() && assign_codes();
+	}
+
+	// code lengths, themselves huffman coded (the huff codec).
+	bool import_huffman(bit_reader &in)
+	{
+		huffman small(24, 6);
+		small.lengths[0] = in.read(3);
+		unsigned start = in.read(3) + 1;
+		unsigned count = 0;
+		for (unsigned i = 1; i < 24; ++i) {
+			if (i < start || count == 7) continue;
+			count = in.read(3);
+			small.lengths[i] = count == 7 ? 0 : count;
+		}
+		if (!small.assign_codes()) return false;
+
+		unsigned rle_bits = 0;
+		for (unsigned t = lengths.size() - 9; t; t >>= 1) ++rle_bits;
+
+		unsigned last = 0;
+		size_t i = 0;
+		while (i < lengths.size()) {
+			unsigned v = small.decode(in);
+			if (v) {
+				lengths[i++] = last = v - 1;
+				continue;
+			}
+			unsigned n = in.read(3) + 2;
+			if (n == 7 + 2) n += in.read(rle_bits);
+			while (n-- && i < lengths.size()) lengths[i++] = last;
+			if (in.overflow()) return false;
+		}
+		return !in.overflow() && assign_codes();
+	}
+};
+
+
+bool inflate_hunk(const unsigned char *in, size_t in_size, unsigned char *out, size_t size)
+{
+	z_stream z = {};
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK) return false;
+	z.next_in = (Bytef *)in;
+	z.avail_in = in_size;
+	z.next_out = out;
+	z.avail_out = size;
+	int ok = inflate(&z, Z_FINISH);
+	bool rv = (ok == Z_STREAM_END || ok == Z_OK || ok == Z_BUF_ERROR) && z.total_out == size;
+	inflateEnd(&z);
+	return rv;
+}
+
+// chdman writes raw LZMA (lc 3, lp 0, pb 2) with no end marker. liblzma's
+// raw decoder wants an end marker, so this fakes a .lzma header with the
+// size in it.
+bool unlzma_hunk(const unsigned char *in, size_t in_size, unsigned char *out, size_t size)
+{
+	unsigned char header[13];
+	uint32_t dict = 4096;
+	while (dict < size && dict < (1u << 30)) dict <<= 1;
+
+	header[0] = (2 * 5 + 0) * 9 + 3;
+	for (int i = 0; i < 4; ++i) header[1 + i] = dict >> (i * 8);
+	for (int i = 0; i < 8; ++i) header[5 + i] = (uint64_t)size >> (i * 8);
+
+	lzma_stream z = LZMA_STREAM_INIT;
+	if (lzma_alone_decoder(&z, UINT64_MAX) != LZMA_OK) return false;
+
+	z.next_in = header;
+	z.avail_in = sizeof(header);
+	z.next_out = out;
+	z.avail_out = size;
+	lzma_ret ok = lzma_code(&z, LZMA_RUN);
+	if (ok == LZMA_OK) {
+		z.next_in = in;
+		z.avail_in = in_size;
+		ok = lzma_code(&z, LZMA_FINISH);
+	}
+	bool rv = (ok == LZMA_STREAM_END || ok == LZMA_OK) && z.total_out == size;
+	lzma_end(&z);
+	return rv;
+}
+
+bool unhuff_hunk(const unsigned char *in, size_t in_size, unsigned char *out, size_t size)
+{
+	bit_reader bits(in, in_size);
+	huffman h(256, 16);
+	if (!h.import_huffman(bits)) return false;
+	for (size_t i = 0; i < size; ++i) out[i] = h.decode(bits);
+	return !bits.overflow();
+}
+
+bool decompress(uint32_t codec, const unsigned char *in, size_t in_size, unsigned char *out, size_t size)
+{
+	if (codec == CODEC_ZLIB) return inflate_hunk(in, in_size, out, size);
+	if (codec == CODEC_LZMA) return unlzma_hunk(in, in_size, out, size);
+	if (codec == CODEC_HUFF) return unhuff_hunk(in, in_size, out, size);
+
+	static std::once_flag once;
+	std::call_once(once, [=](){
+		char name[5] = {};
+		put_be((unsigned char *)name, codec, 4);
+		warnx("CHD codec %s isn't supported", name);
+	});
+	return false;
+}
+
+
+// decompressed hunks, keyed by level << 32 | hunk. a slot is in the map
+// while it's being loaded, so only one thread loads any hunk.
+struct hunk_slot
+{
+	std::vector<unsigned char> data;
+	bool ready = false;
+	bool ok = false;
+	std::list<uint64_t>::iterator lru;
+};
+
+struct hunk_cache
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::unordered_map<uint64_t, std::shared_ptr<hunk_slot>> hunks;
+	std::list<uint64_t> lru; // ready slots, most recent first
+	size_t bytes = 0;
+
+	// work for the read-ahead threads.
+	std::mutex queue_mutex;
+	std::condition_variable queue_cv;
+	std::deque<std::pair<chd_file *, uint32_t>> queue;
+};
+
+// never destroyed: detached workers may still be using it at exit.
+hunk_cache &cache = *new hunk_cache;
+
+void shrink_cache();
+governed memory("chd", hunk_cache_limit, shrink_cache);
+
+// caller holds cache.mutex.
+void evict()
+{
+	size_t limit = memory.limit.load(std::memory_order_relaxed);
+	while (cache.bytes > limit && cache.lru.size() > 1) {
+		auto victim = cache.hunks.find(cache.lru.back());
+		cache.bytes -= victim->second->data.size();
+		cache.hunks.erase(victim);
+		cache.lru.pop_back();
+	}
+	memory.used.store(cache.bytes, std::memory_order_relaxed);
+}
+
+void shrink_cache()
+{
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	evict();
+}
+
+ssize_t chd_read(chd_file &c, void *buf, size_t size, uint64_t offset);
+std::shared_ptr<hunk_slot> get_hunk(chd_file &c, uint32_t hunk);
+
+bool read_hunk(chd_file &c, uint32_t hunk, unsigned char *out)
+{
+	const map_entry &e = c.map[hunk];
+	std::vector<unsigned char> buffer;
+
+	switch (e.type) {
+	case COMPRESSION_TYPE_0:
+	case COMPRESSION_TYPE_1:
+	case COMPRESSION_TYPE_2:
+	case COMPRESSION_TYPE_3:
+		buffer.resize(e.length);
+		if (pread(c.fd, buffer.data(), e.length, e.offset) != (ssize_t)e.length) return false;
+		if (!decompress(c.codecs[e.type], buffer.data(), e.length, out, c.hunk_bytes)) return false;
+		break;
+
+	case COMPRESSION_NONE:
+		if (pread(c.fd, out, c.hunk_bytes, e.offset) != (ssize_t)c.hunk_bytes) return false;
+		break;
+
+	case COMPRESSION_SELF: {
+		auto s = get_hunk(c, e.offset);
+		if (!s->ok) return false;
+		memcpy(out, s->data.data(), c.hunk_bytes);
+		return true;
+	}
+
+	case COMPRESSION_PARENT:
+		return chd_read(*c.parent, out, c.hunk_bytes, e.offset * c.unit_bytes) == (ssize_t)c.hunk_bytes;
+
+	case COMPRESSION_ZERO:
+		memset(out, 0, c.hunk_bytes);
+		return true;
+
+	default:
+		return false;
+	}
+
+	if (e.has_crc && crc16(out, c.hunk_bytes) != e.crc) {
+		warnx("CHD hunk %u: bad CRC", hunk);
+		return false;
+	}
+	return true;
+}
+
+std::shared_ptr<hunk_slot> get_hunk(chd_file &c, uint32_t hunk)
+{
+	uint64_t key = (uint64_t)c.level << 32 | hunk;
+	std::shared_ptr<hunk_slot> s;
+	{
+		std::unique_lock<std::mutex> lock(cache.mutex);
+		auto iter = cache.hunks.find(key);
+		if (iter != cache.hunks.end()) {
+			s = iter->second;
+			cache.cv.wait(lock, [&]{ return s->ready; });
+			if (s->ok && cache.hunks.count(key) && cache.hunks[key] == s)
+				cache.lru.splice(cache.lru.begin(), cache.lru, s->lru);
+			return s;
+		}
+		s = std::make_shared<hunk_slot>();
+		cache.hunks[key] = s;
+	}
+
+	s->data.resize(c.hunk_bytes);
+	bool ok = read_hunk(c, hunk, s->data.data());
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	s->ready = true;
+	s->ok = ok;
+	if (ok) {
+		cache.lru.push_front(key);
+		s->lru = cache.lru.begin();
+		cache.bytes += s->data.size();
+		evict();
+	} else {
+		cache.hunks.erase(key);
+	}
+	cache.cv.notify_all();
+	return s;
+}
+
+void worker()
+{
+	for (;;) {
+		std::pair<chd_file *, uint32_t> job;
+		{
+			std::unique_lock<std::mutex> lock(cache.queue_mutex);
+			cache.queue_cv.wait(lock, []{ return !cache.queue.empty(); });
+			job = cache.queue.front();
+			cache.queue.pop_front();
+		}
+		get_hunk(*job.first, job.second);
+	}
+}
+
+// queue [first, last] for the workers, skipping anything already cached.
+void prefetch(chd_file &c, uint64_t first, uint64_t last)
+{
+	if (!workers_running) return;
+	last = std::min<uint64_t>(last, c.hunk_count - 1);
+	if (first > last) return;
+
+	std::vector<uint32_t> wanted;
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		for (uint64_t h = first; h <= last; ++h) {
+			if (!cache.hunks.count((uint64_t)c.level << 32 | h)) wanted.push_back(h);
+		}
+	}
+	if (wanted.empty()) return;
+
+	std::lock_guard<std::mutex> lock(cache.queue_mutex);
+	for (uint32_t h : wanted) {
+		if (cache.queue.size() >= max_queue) break;
+		cache.queue.emplace_back(&c, h);
+	}
+	cache.queue_cv.notify_all();
+}
+
+ssize_t chd_read(chd_file &c, void *buf, size_t size, uint64_t offset)
+{
+	if (offset >= c.logical_size || !size) return 0;
+	size = std::min<uint64_t>(size, c.logical_size - offset);
+
+	uint64_t first = offset / c.hunk_bytes;
+	uint64_t last = (offset + size - 1) / c.hunk_bytes;
+
+	// the rest of this request, and the next few hunks if this looks sequential.
+	uint64_t ahead = last;
+	if (c.next_offset.exchange(offset + size) == offset) ahead += read_ahead;
+	prefetch(c, first + 1, ahead);
+
+	char *out = (char *)buf;
+	for (uint64_t h = first; h <= last; ++h) {
+		auto s = get_hunk(c, h);
+		if (!s->ok) {
+			errno = EIO;
+			return -1;
+		}
+		uint64_t start = h * c.hunk_bytes;
+		uint64_t begin = std::max(offset, start);
+		uint64_t end = std::min(offset + size, start + c.hunk_bytes);
+		memcpy(out + (begin - offset), s->data.data() + (begin - start), end - begin);
+	}
+	return size;
+}
+
+
+void decode_map(chd_file &c, const char *path)
+{
+	uint64_t map_offset = c.map_offset;
+	unsigned char header[16];
+
+	if (!c.codecs[0]) {
+		// uncompressed: a 32-bit hunk number per hunk; 0 means not present.
+		std::vector<unsigned char> raw((size_t)c.hunk_count * 4);
+		if (pread(c.fd, raw.data(), raw.size(), map_offset) != (ssize_t)raw.size())
+			errx(1, "%s: unable to read the CHD map", path);
+		for (uint32_t h = 0; h < c.hunk_count; ++h) {
+			uint64_t n = be(&raw[h * 4], 4);
+			map_entry e = { COMPRESSION_NONE, false, 0, c.hunk_bytes, n * c.hunk_bytes };
+			if (!n) {
+				e.type = c.parent ? COMPRESSION_PARENT : COMPRESSION_ZERO;
+				e.offset = (uint64_t)h * c.hunk_bytes / c.unit_bytes;
+			}
+			c.map.push_back(e);
+		}
+		return;
+	}
+
+	if (pread(c.fd, header, sizeof(header), map_offset) != sizeof(header))
+		errx(1, "%s: unable to read the CHD map", path);
+
+	uint32_t map_bytes = be(header + 0, 4);
+	uint64_t offset = be(header + 4, 6);
+	uint16_t map_crc = be(header + 10, 2);
+	unsigned length_bits = header[12];
+	unsigned self_bits = header[13];
+	unsigned parent_bits = header[14];
+
+	std::vector<unsigned char> compressed(map_bytes);
+	if (pread(c.fd, compressed.data(), map_bytes, map_offset + 16) != (ssize_t)map_bytes)
+		errx(1, "%s: unable to read the CHD map", path);
+
+	bit_reader bits(compressed.data(), compressed.size());
+	huffman types(16, 8);
+	if (!types.import_rle(bits)) errx(1, "%s: corrupt CHD map", path);
+
+	c.map.resize(c.hunk_count);
+	uint8_t last_type = 0;
+	unsigned repeat = 0;
+	for (auto &e : c.map) {
+		if (repeat) {
+			e.type = last_type;
+			--repeat;
+			continue;
+		}
+		unsigned t = types.decode(bits);
+		if (t == COMPRESSION_RLE_SMALL) {
+			e.type = last_type;
+			repeat = 2 + types.decode(bits);
+		} else if (t == COMPRESSION_RLE_LARGE) {
+			e.type = last_type;
+			repeat = 2 + 16 + (types.decode(bits) << 4);
+			repeat += types.decode(bits);
+		} else {
+			e.type = last_type = t;
+		}
+	}
+
+	// the same 12 bytes per hunk MAME computes the CRC over.
+	std::vector<unsigned char> raw((size_t)c.hunk_count * 12);
+	uint64_t last_self = 0;
+	uint64_t last_parent = 0;
+	for (uint32_t h = 0; h < c.hunk_count; ++h) {
+		map_entry &e = c.map[h];
+		e.has_crc = false;
+		e.crc = 0;
+		e.length = 0;
+		e.offset = offset;
+
+		switch (e.type) {
+		case COMPRESSION_TYPE_0:
+		case COMPRESSION_TYPE_1:
+		case COMPRESSION_TYPE_2:
+		case COMPRESSION_TYPE_3:
+			e.length = bits.read(length_bits);
+			offset += e.length;
+			e.crc = bits.read(16);
+			e.has_crc = true;
+			break;
+		case COMPRESSION_NONE:
+			e.length = c.hunk_bytes;
+			offset += e.length;
+			e.crc = bits.read(16);
+			e.has_crc = true;
+			break;
+		case COMPRESSION_SELF:
+			e.offset = last_self = bits.read(self_bits);
+			break;
+		case COMPRESSION_PARENT:
+			e.offset = last_parent = bits.read(parent_bits);
+			break;
+		case COMPRESSION_SELF_1:
+			++last_self;
+			// fall through
+		case COMPRESSION_SELF_0:
+			e.type = COMPRESSION_SELF;
+			e.offset = last_self;
+			break;
+		case COMPRESSION_PARENT_SELF:
+			e.type = COMPRESSION_PARENT;
+			e.offset = last_parent = (uint64_t)h * c.hunk_bytes / c.unit_bytes;
+			break;
+		case COMPRESSION_PARENT_1:
+			last_parent += c.hunk_bytes / c.unit_bytes;
+			// fall through
+		case COMPRESSION_PARENT_0:
+			e.type = COMPRESSION_PARENT;
+			e.offset = last_parent;
+			break;
+		default:
+			errx(1, "%s: corrupt CHD map", path);
+		}
+
+		raw[h * 12] = e.type;
+		put_be(&raw[h * 12 + 1], e.length, 3);
+		put_be(&raw[h * 12 + 4], e.offset, 6);
+		put_be(&raw[h * 12 + 10], e.crc, 2);
+
+		// self references are always to an earlier hunk, so loading never waits on itself.
+		if (e.type == COMPRESSION_SELF && e.offset >= h) errx(1, "%s: corrupt CHD map", path);
+		if (e.type == COMPRESSION_PARENT && !c.parent) errx(1, "%s: CHD map refers to a missing parent", path);
+	}
+
+	if (bits.overflow() || crc16(raw.data(), raw.size()) != map_crc)
+		errx(1, "%s: corrupt CHD map", path);
+}
+
+// false if fd isn't a CHD.
+bool load(chd_file &c, int fd, const char *path)
+{
+	unsigned char data[header_size];
+
+	if (pread(fd, data, sizeof(data), 0) != sizeof(data) || memcmp(data, "MComprHD", 8)) return false;
+
+	unsigned version = be(data + 12, 4);
+	if (version != 5)
+		errx(1, "%s: CHD version %u isn't supported (chdman copy converts it to version 5)", path, version);
+
+	c.fd = fd;
+	for (int i = 0; i < 4; ++i) c.codecs[i] = be(data + 16 + i * 4, 4);
+	c.logical_size = be(data + 32, 8);
+	c.map_offset = be(data + 40, 8);
+	c.hunk_bytes = be(data + 56, 4);
+	c.unit_bytes = be(data + 60, 4);
+	memcpy(c.sha1, data + 84, 20);
+	memcpy(c.parent_sha1, data + 104, 20);
+
+	if (!c.hunk_bytes || !c.unit_bytes || c.hunk_bytes % c.unit_bytes)
+		errx(1, "%s: bad CHD header", path);
+	uint64_t count = (c.logical_size + c.hunk_bytes - 1) / c.hunk_bytes;
+	if (count > UINT32_MAX) errx(1, "%s: bad CHD header", path);
+	c.hunk_count = count;
+	return true;
+}
+
+bool has_parent(const chd_file &c)
+{
+	static const unsigned char zero[20] = {};
+	return memcmp(c.parent_sha1, zero, 20) != 0;
+}
+
+} // namespace
+
+
+bool chd_open(int fd, const char *path, const char *parent, off_t &size)
+{
+	std::unique_ptr<chd_file> c(new chd_file);
+
+	if (!load(*c, fd, path)) return false;
+
+	if (has_parent(*c)) {
+		if (!parent) errx(1, "%s: this CHD is a diff; -oparent=PATH names its parent", path);
+
+		int pfd = open(parent, O_RDONLY);
+		if (pfd < 0) err(1, "Unable to open %s", parent);
+		c->parent.reset(new chd_file);
+		if (!load(*c->parent, pfd, parent)) errx(1, "%s: not a CHD", parent);
+		if (memcmp(c->parent->sha1, c->parent_sha1, 20))
+			errx(1, "%s: not the parent of %s", parent, path);
+		if (has_parent(*c->parent))
+			errx(1, "%s: is itself a diff; only one level of parent is supported", parent);
+		c->parent->level = 1;
+		decode_map(*c->parent, parent);
+	}
+	decode_map(*c, path);
+
+	size = c->logical_size;
+	top = c.release();
+	governor_add(memory);
+	return true;
+}
+
+bool chd_enabled()
+{
+	return top != nullptr;
+}
+
+void chd_start()
+{
+	if (!top || workers_running.exchange(true)) return;
+
+	unsigned n = std::min(std::max(std::thread::hardware_concurrency(), 2u), 4u);
+	for (unsigned i = 0; i < n; ++i) std::thread(worker).detach();
+}
+
+ssize_t device_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	if (!slow_io(offset, size, false)) return -1;
+	if (top && fd == top->fd) return chd_read(*top, buf, size, offset);
+	return pread(fd, buf, size, offset);
+}
+
+ssize_t device_preadv(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	if (slow_enabled()) {
+		size_t size = 0;
+		for (int i = 0; i < count; ++i) size += iov[i].iov_len;
+		if (!slow_io(offset, size, false)) return -1;
+	}
+	if (!top || fd != top->fd) return preadv(fd, iov, count, offset);
+
+	ssize_t total = 0;
+	for (int i = 0; i < count; ++i) {
+		ssize_t ok = chd_read(*top, iov[i].iov_base, iov[i].iov_len, offset + total);
+		if (ok < 0) return total ? total : -1;
+		total += ok;
+		if ((size_t)ok < iov[i].iov_len) break;
+	}
+	return total;
+}
+
+ssize_t device_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	if (!slow_io(offset, size, true)) return -1;
+	return pwrite(fd, buf, size, offset);
+}
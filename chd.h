@@ -0,0 +1,34 @@
+#ifndef chd_h
+#define chd_h
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * MAME CHD (v5) hard disk images as a backing store.
+ *
+ * Everything that reads the device goes through device_pread, which is
+ * pread(2) unless fd is an open CHD, in which case it reads the logical
+ * (decompressed) disk. Writes go through device_pwrite. Both are where
+ * -oslow charges its delays.
+ */
+
+// true if fd is a CHD; size is its logical size. parent is the parent CHD
+// for a delta (diff) image, or nullptr. exits with a message if fd is a CHD
+// that can't be used.
+bool chd_open(int fd, const char *path, const char *parent, off_t &size);
+
+bool chd_enabled();
+
+// starts the decompression threads. threads don't survive fuse_main
+// daemonizing, so this is called from init; until then hunks are
+// decompressed by the reader.
+void chd_start();
+
+// same contract as pread(2) / preadv(2).
+ssize_t device_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t device_preadv(int fd, const struct iovec *iov, int count, off_t offset);
+// same contract as pwrite(2); CHDs are never opened for writing.
+ssize_t device_pwrite(int fd, const void *buf, size_t size, off_t offset);
+
+#endif
@@ -0,0 +1,395 @@
+
+#include <sysexits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ii-part.h"
+#include "prodos.h"
+
+/*
+ * --check: walk every ProDOS volume and compare the blocks reachable from
+ * the directory tree with the volume bitmap.
+ *
+ * Directory, index and key blocks are read a level at a time; each level is
+ * sorted and neighbouring blocks are merged into single reads. Data blocks
+ * are only marked, never read.
+ */
+
+namespace {
+
+enum {
+	READ_DIRECTORY,
+	READ_INDEX,
+	READ_MASTER_INDEX,
+	READ_EXTENDED,
+};
+
+struct pending
+{
+	unsigned block;
+	unsigned kind;
+	unsigned owner; // index into checker::paths
+
+	// directories only.
+	bool key;
+	unsigned entry_length;
+	unsigned entries_per_block;
+};
+
+const unsigned max_messages = 50;
+
+struct checker
+{
+	const prodos_volume &v;
+
+	// one bit per block, in the same layout as the volume bitmap.
+	std::vector<unsigned char> reach;
+	std::vector<unsigned> owner;
+	std::vector<std::string> paths;
+	std::vector<pending> next;
+
+	unsigned files = 0;
+	unsigned directories = 0;
+	unsigned cross_linked = 0;
+	unsigned out_of_range = 0;
+	unsigned leaked = 0;
+	unsigned marked_free = 0;
+	unsigned free_count = 0;
+	std::vector<std::string> messages;
+	unsigned dropped = 0;
+
+	checker(const prodos_volume &v) : v(v)
+	{
+		// rounded up to whole 64-bit words.
+		reach.resize((v.total_blocks + 63) / 64 * 8);
+		owner.resize(v.total_blocks);
+	}
+
+	void message(const std::string &s)
+	{
+		if (messages.size() < max_messages) messages.push_back(s);
+		else ++dropped;
+	}
+
+	bool test(unsigned block) const
+	{
+		return reach[block >> 3] & (0x80 >> (block & 7));
+	}
+
+	unsigned add_path(const std::string &path)
+	{
+		paths.push_back(path);
+		return paths.size() - 1;
+	}
+
+	bool mark(unsigned block, unsigned who)
+	{
+		if (block >= v.total_blocks) {
+			++out_of_range;
+			message(paths[who] + ": block " + std::to_string(block) + " out of range");
+			return false;
+		}
+		if (test(block)) {
+			++cross_linked;
+			message("block " + std::to_string(block) + ": cross-linked (" + paths[owner[block]] + ", " + paths[who] + ")");
+			return false;
+		}
+		reach[block >> 3] |= 0x80 >> (block & 7);
+		owner[block] = who;
+		return true;
+	}
+
+	// index blocks are followed even when cross-linked so the blocks they
+	// point to aren't reported as leaked. (directories aren't, to avoid loops.)
+	void visit(unsigned block, unsigned kind, unsigned who)
+	{
+		if (mark(block, who) || block < v.total_blocks)
+			next.push_back({ block, kind, who, false, 0, 0 });
+	}
+
+	void fork(unsigned storage_type, unsigned key, unsigned who)
+	{
+		switch (storage_type) {
+			case STORAGE_SEEDLING:
+				mark(key, who);
+				break;
+			case STORAGE_SAPLING:
+				visit(key, READ_INDEX, who);
+				break;
+			case STORAGE_TREE:
+				visit(key, READ_MASTER_INDEX, who);
+				break;
+			default:
+				message(paths[who] + ": bad storage type " + std::to_string(storage_type));
+				break;
+		}
+	}
+
+	void entry(const prodos_entry &e, unsigned who)
+	{
+		switch (e.storage_type) {
+			case STORAGE_SEEDLING:
+			case STORAGE_SAPLING:
+			case STORAGE_TREE:
+				++files;
+				fork(e.storage_type, e.key_pointer, who);
+				break;
+
+			case STORAGE_EXTENDED:
+				++files;
+				visit(e.key_pointer, READ_EXTENDED, who);
+				break;
+
+			case STORAGE_SUBDIR:
+				++directories;
+				if (mark(e.key_pointer, who))
+					next.push_back({ e.key_pointer, READ_DIRECTORY, who, true, 0, 0 });
+				break;
+
+			case STORAGE_PASCAL:
+				++files;
+				for (unsigned i = 0; i < e.blocks_used; ++i)
+					mark(e.key_pointer + i, who);
+				break;
+
+			default:
+				message(paths[who] + ": bad storage type " + std::to_string(e.storage_type));
+				break;
+		}
+	}
+
+	void directory(const unsigned char *data, pending p)
+	{
+		if (p.key) {
+			unsigned type = data[0x04] >> 4;
+			if (type != STORAGE_VOLUME_HEADER && type != STORAGE_SUBDIR_HEADER) {
+				message(paths[p.owner] + ": block " + std::to_string(p.block) + " is not a directory");
+				return;
+			}
+			p.entry_length = data[0x23];
+			p.entries_per_block = data[0x24];
+			if (p.entry_length < 0x27 || p.entries_per_block == 0 || 4 + p.entry_length * p.entries_per_block > 512) {
+				message(paths[p.owner] + ": bad directory header");
+				return;
+			}
+		}
+
+		const std::string &dir = paths[p.owner];
+		for (unsigned i = p.key ? 1 : 0; i < p.entries_per_block; ++i) {
+			const unsigned char *ptr = data + 4 + i * p.entry_length;
+			if ((ptr[0] >> 4) == STORAGE_DELETED) continue;
+
+			prodos_entry e;
+			prodos_parse_entry(ptr, e);
+			entry(e, add_path(dir + "/" + e.name));
+		}
+
+		unsigned link = read16(data + 2);
+		if (link && mark(link, p.owner))
+			next.push_back({ link, READ_DIRECTORY, p.owner, false, p.entry_length, p.entries_per_block });
+	}
+
+	void index(const unsigned char *data, unsigned kind, unsigned who)
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			unsigned block = data[i] | (data[256 + i] << 8);
+			if (!block) continue; // sparse
+			if (kind == READ_MASTER_INDEX) visit(block, READ_INDEX, who);
+			else mark(block, who);
+		}
+	}
+
+	void extended(const unsigned char *data, unsigned who)
+	{
+		// mini entries for the data and resource forks.
+		for (unsigned offset : { 0x000, 0x100 }) {
+			const unsigned char *ptr = data + offset;
+			fork(ptr[0x00], read16(ptr + 0x01), who);
+		}
+	}
+
+	bool walk()
+	{
+		std::vector<unsigned char> buffer;
+		unsigned boot = add_path("(boot)");
+		unsigned bitmap = add_path("(bitmap)");
+		unsigned root = add_path("");
+
+		mark(0, boot);
+		mark(1, boot);
+		for (unsigned i = 0; i < v.bitmap_blocks(); ++i)
+			mark(v.bitmap_pointer + i, bitmap);
+
+		if (mark(2, root)) next.push_back({ 2, READ_DIRECTORY, root, true, 0, 0 });
+
+		while (!next.empty()) {
+			std::vector<pending> batch;
+			batch.swap(next);
+
+			if (!prodos_read_sorted(v, batch, buffer)) {
+				message(std::string("read error: ") + strerror(errno));
+				return false;
+			}
+
+			for (size_t i = 0; i < batch.size(); ++i) {
+				const unsigned char *data = buffer.data() + i * 512;
+				const pending &p = batch[i];
+
+				switch (p.kind) {
+					case READ_DIRECTORY: directory(data, p); break;
+					case READ_INDEX:
+					case READ_MASTER_INDEX: index(data, p.kind, p.owner); break;
+					case READ_EXTENDED: extended(data, p.owner); break;
+				}
+			}
+		}
+		return true;
+	}
+
+	static std::string ranges(const std::vector<unsigned> &blocks)
+	{
+		std::string s;
+		for (size_t i = 0; i < blocks.size(); ) {
+			size_t j = i;
+			while (j + 1 < blocks.size() && blocks[j + 1] == blocks[j] + 1) ++j;
+			if (!s.empty()) s += ", ";
+			s += std::to_string(blocks[i]);
+			if (j > i) s += "-" + std::to_string(blocks[j]);
+			i = j + 1;
+		}
+		return s;
+	}
+
+	// compare reachability with the bitmap a word at a time.
+	bool compare()
+	{
+		std::vector<unsigned char> bitmap(std::max(v.bitmap_blocks() * 512, (unsigned)reach.size()));
+		if (!v.read(v.bitmap_pointer, v.bitmap_blocks(), bitmap.data())) {
+			message(std::string("unable to read bitmap: ") + strerror(errno));
+			return false;
+		}
+
+		// bits past the end of the volume are don't-cares.
+		std::vector<unsigned char> valid(reach.size(), 0xff);
+		for (unsigned block = v.total_blocks; block < reach.size() * 8; ++block)
+			valid[block >> 3] &= ~(0x80 >> (block & 7));
+
+		std::vector<unsigned> leaked_blocks;
+		std::vector<unsigned> free_blocks;
+
+		for (size_t w = 0; w < reach.size(); w += 8) {
+			uint64_t r, b, m;
+			memcpy(&r, &reach[w], 8);
+			memcpy(&b, &bitmap[w], 8);
+			memcpy(&m, &valid[w], 8);
+
+			// a set bit in the bitmap means free.
+			uint64_t lost = ~b & ~r & m;
+			uint64_t wrong = b & r & m;
+			free_count += __builtin_popcountll(b & m);
+			if (!(lost | wrong)) continue;
+
+			leaked += __builtin_popcountll(lost);
+			marked_free += __builtin_popcountll(wrong);
+
+			unsigned char lb[8], wb[8];
+			memcpy(lb, &lost, 8);
+			memcpy(wb, &wrong, 8);
+			for (unsigned i = 0; i < 64; ++i) {
+				unsigned mask = 0x80 >> (i & 7);
+				unsigned block = w * 8 + i;
+				if (lb[i >> 3] & mask) leaked_blocks.push_back(block);
+				if (wb[i >> 3] & mask) free_blocks.push_back(block);
+			}
+		}
+
+		for (unsigned block : free_blocks)
+			message("block " + std::to_string(block) + ": in use by " + paths[owner[block]] + " but marked free");
+		if (!leaked_blocks.empty())
+			message("leaked blocks: " + ranges(leaked_blocks));
+		return true;
+	}
+};
+
+std::string check_one(const file_info &f, bool &ok)
+{
+	prodos_volume v;
+	std::string report = f.name + ": ";
+
+	if (!v.open(fd, f)) {
+		ok = true;
+		return report + "not a ProDOS volume\n";
+	}
+
+	checker c(v);
+	ok = c.walk() && c.compare();
+
+	if (v.total_blocks > v.blocks) {
+		c.message("volume claims " + std::to_string(v.total_blocks) + " blocks but the partition has " + std::to_string(v.blocks));
+		ok = false;
+	}
+
+	report += v.name + ", " + std::to_string(v.total_blocks) + " blocks, "
+		+ std::to_string(v.total_blocks - c.free_count) + " used, "
+		+ std::to_string(c.free_count) + " free, "
+		+ std::to_string(c.files) + " files, "
+		+ std::to_string(c.directories) + " directories: ";
+
+	if (c.cross_linked || c.out_of_range || c.leaked || c.marked_free) ok = false;
+
+	if (ok) report += "ok\n";
+	else {
+		report += std::to_string(c.cross_linked) + " cross-linked, "
+			+ std::to_string(c.leaked) + " leaked, "
+			+ std::to_string(c.marked_free) + " marked free, "
+			+ std::to_string(c.out_of_range) + " out of range\n";
+	}
+
+	for (const auto &m : c.messages)
+		report += "    " + m + "\n";
+	if (c.dropped)
+		report += "    ... " + std::to_string(c.dropped) + " more\n";
+
+	return report;
+}
+
+} // namespace
+
+
+int check_volumes()
+{
+	std::vector<std::string> reports(files.size());
+	std::atomic<unsigned> next(0);
+	std::atomic<bool> bad(false);
+
+	// mostly waiting on i/o, so use a few threads even on small machines.
+	unsigned count = std::max(std::thread::hardware_concurrency(), 4u);
+	count = std::min(count, (unsigned)files.size());
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < count; ++i) {
+		threads.emplace_back([&](){
+			for (;;) {
+				unsigned index = next++;
+				if (index >= files.size()) break;
+
+				bool ok;
+				reports[index] = check_one(files[index], ok);
+				if (!ok) bad = true;
+			}
+		});
+	}
+	for (auto &t : threads) t.join();
+
+	for (const auto &r : reports)
+		fputs(r.c_str(), stdout);
+
+	return bad ? EX_DATAERR : EX_OK;
+}
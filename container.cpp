@@ -0,0 +1,165 @@
+
+#include <err.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define FUSE_USE_VERSION 27
+#include <fuse.h>
+
+#include "ii-part.h"
+
+/*
+ * -ocontainers=2mg:hdv:po: every partition also appears as NAME.2mg (and
+ * so on), wrapped the way an emulator wants it.
+ *
+ * Headers are generated at mount time and live in memory; everything after
+ * the header is the partition, read and written through the partition
+ * operations (so read_buf hands fuse the device descriptor, as it does for
+ * the partition itself). .hdv and .po have no header at all.
+ */
+
+namespace {
+
+struct view
+{
+	std::string name;
+	std::string partition; // "/NAME"
+	std::vector<unsigned char> header;
+	off_t size;
+};
+
+std::vector<view> views;
+struct fuse_operations base;
+
+
+const view *find_view(const char *path)
+{
+	for (const auto &v : views) {
+		if (v.name == path + 1) return &v;
+	}
+	return nullptr;
+}
+
+
+int container_getattr(const char *path, struct stat *stbuf)
+{
+	const view *v = find_view(path);
+	if (!v) return base.getattr(path, stbuf);
+
+	int ok = base.getattr(v->partition.c_str(), stbuf);
+	if (ok < 0) return ok;
+	stbuf->st_size = v->size;
+	stbuf->st_blocks = (v->size + 511) / 512;
+	return 0;
+}
+
+int container_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	int ok = base.readdir(path, buf, filler, offset, fi);
+	if (ok < 0 || strcmp(path, "/")) return ok;
+
+	for (const auto &v : views)
+		filler(buf, v.name.c_str(), NULL, 0);
+	return 0;
+}
+
+int container_open(const char *path, struct fuse_file_info *fi)
+{
+	const view *v = find_view(path);
+	return base.open(v ? v->partition.c_str() : path, fi);
+}
+
+int container_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const view *v = find_view(path);
+	if (!v) return base.read(path, buf, size, offset, fi);
+
+	off_t hsize = v->header.size();
+	size_t n = 0;
+	if (offset < hsize) {
+		n = std::min<size_t>(size, hsize - offset);
+		memcpy(buf, v->header.data() + offset, n);
+		if (n == size) return n;
+	}
+
+	int ok = base.read(v->partition.c_str(), buf + n, size - n, offset + n - hsize, fi);
+	if (ok < 0) return n ? n : ok;
+	return n + ok;
+}
+
+int container_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const view *v = find_view(path);
+	if (!v) return base.read_buf(path, bufp, size, offset, fi);
+
+	off_t hsize = v->header.size();
+	if (offset >= hsize)
+		return base.read_buf(v->partition.c_str(), bufp, size, offset - hsize, fi);
+
+	auto iter = std::find(files.begin(), files.end(), v->partition.substr(1));
+	if (iter == files.end()) return -ENOENT;
+
+	size_t n = std::min<size_t>(size, hsize - offset);
+	size_t rest = std::min<off_t>(size - n, iter->size);
+	*bufp = device_bufvec(v->header.data() + offset, n, iter->start, rest);
+	if (!*bufp) return -errno;
+	return 0;
+}
+
+int container_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const view *v = find_view(path);
+	if (!v) return base.write(path, buf, size, offset, fi);
+
+	// the header is made up; only the payload can change.
+	off_t hsize = v->header.size();
+	if (offset < hsize) return -EPERM;
+	return base.write(v->partition.c_str(), buf, size, offset - hsize, fi);
+}
+
+} // namespace
+
+
+void container_setup(struct fuse_operations &ops)
+{
+	std::vector<std::string> kinds;
+	std::string list = options.containers;
+	size_t pos = 0;
+	while (pos <= list.size()) {
+		size_t end = std::min(list.find(':', pos), list.size());
+		std::string kind = list.substr(pos, end - pos);
+		pos = end + 1;
+		if (kind != "2mg" && kind != "hdv" && kind != "po")
+			errx(1, "-ocontainers: unknown container %s (2mg, hdv or po)", kind.c_str());
+		kinds.push_back(kind);
+	}
+
+	for (const auto &f : files) {
+		for (const auto &kind : kinds) {
+			view v;
+			v.name = f.name + "." + kind;
+			v.partition = "/" + f.name;
+			if (kind == "2mg") v.header = make_2mg_header(f.size, !options.rw);
+			v.size = v.header.size() + f.size;
+
+			if (std::find(files.begin(), files.end(), v.name) != files.end()) {
+				warnx("%s: a partition has that name; not adding the container", v.name.c_str());
+				continue;
+			}
+			views.push_back(std::move(v));
+		}
+	}
+
+	base = ops;
+	ops.getattr  = container_getattr;
+	ops.readdir  = container_readdir;
+	ops.open     = container_open;
+	ops.read     = container_read;
+	ops.read_buf = container_read_buf;
+	ops.write    = container_write;
+}
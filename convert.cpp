@@ -0,0 +1,263 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chd.h"
+#include "ii-part.h"
+
+/*
+ * --convert=OUTPUT input [NAME]: copy one volume to OUTPUT, rewrapped.
+ *
+ * The input is a card image (or a CHD of one), in which case NAME picks the
+ * partition, or a single volume: .2mg (either order), .do/.dsk (DOS order)
+ * or anything else (ProDOS order). The output format comes from its
+ * extension: .2mg gets a generated header, .do/.dsk is DOS order and the
+ * rest are plain ProDOS order.
+ *
+ * A reader thread fills a ring of large buffers (reordering sectors as it
+ * goes) while the main thread writes them out, so reading and writing
+ * overlap and at most the ring is in memory, whatever the size of the
+ * volume.
+ */
+
+namespace {
+
+const size_t chunk_size = 4 << 20; // a multiple of the track size
+const unsigned ring_size = 4;
+
+struct source
+{
+	int fd = -1;
+	off_t offset = 0;
+	off_t size = 0;
+	bool dos_order = false;
+};
+
+bool has_extension(const char *path, const char *ext)
+{
+	const char *dot = strrchr(path, '.');
+	return dot && !strcasecmp(dot + 1, ext);
+}
+
+bool is_dos_order(const char *path)
+{
+	return has_extension(path, "do") || has_extension(path, "dsk");
+}
+
+// a 16-sector track in one order to the other. both interleave the sectors
+// on the disk, differently; going through the physical sector, DOS sector
+// n is ProDOS sector 15 - n (except 0 and 15), so one table goes both ways.
+const unsigned char reorder_table[16] = {
+	0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 15
+};
+
+void reorder(unsigned char *data, size_t size)
+{
+	unsigned char track[16 * 256];
+
+	for (size_t i = 0; i + sizeof(track) <= size; i += sizeof(track)) {
+		memcpy(track, data + i, sizeof(track));
+		for (unsigned s = 0; s < 16; ++s)
+			memcpy(data + i + s * 256, track + reorder_table[s] * 256, 256);
+	}
+}
+
+bool open_source(const char *path, const std::vector<const char *> &names, source &s)
+{
+	unsigned char header[512 * FOCUS_HEADER_BLOCKS] = {};
+	off_t size;
+
+	s.fd = open(path, O_RDONLY);
+	if (s.fd < 0) {
+		warn("%s", path);
+		return false;
+	}
+	bool chd = chd_open(s.fd, path, options.parent, size);
+	if (!chd) size = file_size(s.fd);
+	if (size == (off_t)-1 || device_pread(s.fd, header, std::min<off_t>(sizeof(header), size), 0) < 0) {
+		warn("%s", path);
+		return false;
+	}
+	if (chd) chd_start();
+
+	// the same headers setup() understands.
+	std::vector<file_info> parts;
+	if (size >= (off_t)sizeof(header) && (is_focus(header) || is_zip(header)))
+		parse_focus(header, parts);
+	else if (size >= 512 && is_microdrive(header))
+		parse_microdrive(header, parts);
+
+	if (!parts.empty()) {
+		if (names.size() > 1 || (names.empty() && parts.size() > 1)) {
+			warnx("%s: name one partition:", path);
+			for (const auto &f : parts) fprintf(stderr, "    %s\n", f.name.c_str());
+			return false;
+		}
+		auto iter = names.empty() ? parts.begin() : std::find(parts.begin(), parts.end(), names[0]);
+		if (iter == parts.end()) {
+			warnx("%s: no such partition", names[0]);
+			return false;
+		}
+		s.offset = iter->start;
+		s.size = iter->size;
+		return true;
+	}
+
+	if (!names.empty()) {
+		warnx("%s: not a partitioned image", path);
+		return false;
+	}
+
+	unsigned format = IMG_PRODOS_ORDER;
+	if (size >= 64 && !memcmp(header, "2IMG", 4)) {
+		if (!parse_2mg(header, size, s.offset, s.size, format) || format > IMG_PRODOS_ORDER) {
+			warnx("%s: unsupported .2mg", path);
+			return false;
+		}
+	} else {
+		s.size = size;
+		if (is_dos_order(path)) format = IMG_DOS_ORDER;
+	}
+	s.dos_order = format == IMG_DOS_ORDER;
+	return true;
+}
+
+// the buffers, and how many are full. slot i of the ring holds chunk i,
+// i + ring_size, ...; the reader only fills a slot the writer has emptied.
+struct ring
+{
+	std::vector<unsigned char> buffers[ring_size];
+	unsigned full = 0;
+	bool failed = false;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+void read_chunks(ring &r, const source &s, bool reordering, unsigned chunks)
+{
+	for (unsigned i = 0; i < chunks; ++i) {
+		{
+			std::unique_lock<std::mutex> lock(r.mutex);
+			r.cv.wait(lock, [&]{ return r.full < ring_size || r.failed; });
+			if (r.failed) return;
+		}
+
+		auto &buffer = r.buffers[i % ring_size];
+		off_t offset = (off_t)i * chunk_size;
+		size_t size = std::min<off_t>(chunk_size, s.size - offset);
+		ssize_t ok = device_pread(s.fd, buffer.data(), size, s.offset + offset);
+		if (ok != (ssize_t)size) {
+			if (ok >= 0) errno = EIO;
+			warn("read");
+		} else if (reordering) {
+			reorder(buffer.data(), size);
+		}
+
+		std::lock_guard<std::mutex> lock(r.mutex);
+		if (ok != (ssize_t)size) r.failed = true;
+		else ++r.full;
+		r.cv.notify_all();
+	}
+}
+
+bool write_chunks(ring &r, const source &s, int out, off_t out_offset, unsigned chunks)
+{
+	for (unsigned i = 0; i < chunks; ++i) {
+		{
+			std::unique_lock<std::mutex> lock(r.mutex);
+			r.cv.wait(lock, [&]{ return r.full > 0 || r.failed; });
+			if (!r.full) return false;
+		}
+
+		const auto &buffer = r.buffers[i % ring_size];
+		off_t offset = (off_t)i * chunk_size;
+		size_t size = std::min<off_t>(chunk_size, s.size - offset);
+		bool ok = pwrite(out, buffer.data(), size, out_offset + offset) == (ssize_t)size;
+		if (!ok) warn("write");
+
+		std::lock_guard<std::mutex> lock(r.mutex);
+		if (!ok) r.failed = true;
+		else --r.full;
+		r.cv.notify_all();
+		if (!ok) return false;
+	}
+	return true;
+}
+
+} // namespace
+
+
+int convert_image(const char *output, const char *input, const std::vector<const char *> &names)
+{
+	source s;
+	if (!open_source(input, names, s)) return EX_DATAERR;
+
+	bool to_2mg = has_extension(output, "2mg");
+	bool to_dos = is_dos_order(output);
+	bool reordering = s.dos_order != to_dos;
+
+	if (!s.size || (s.size & 511)) {
+		warnx("%s: bad volume size", input);
+		return EX_DATAERR;
+	}
+	if (reordering && (s.size & 4095)) {
+		warnx("%s: not a whole number of tracks; can't change the sector order", input);
+		return EX_DATAERR;
+	}
+	if (to_2mg && s.size > 0xffffffff) {
+		warnx("%s: too large for .2mg", output);
+		return EX_DATAERR;
+	}
+
+	int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		warn("%s", output);
+		return EX_CANTCREAT;
+	}
+
+	off_t out_offset = 0;
+	if (to_2mg) {
+		std::vector<unsigned char> header = make_2mg_header(s.size, false);
+		if (write(out, header.data(), header.size()) != (ssize_t)header.size()) {
+			warn("%s", output);
+			close(out);
+			return EX_IOERR;
+		}
+		out_offset = header.size();
+	}
+
+	ring r;
+	for (auto &b : r.buffers) b.resize(chunk_size);
+	unsigned chunks = (s.size + chunk_size - 1) / chunk_size;
+
+	std::thread reader(read_chunks, std::ref(r), std::cref(s), reordering, chunks);
+	bool ok = write_chunks(r, s, out, out_offset, chunks);
+	reader.join();
+
+	ok = ok && fsync(out) == 0;
+	ok = close(out) == 0 && ok;
+	close(s.fd);
+	if (!ok) {
+		warnx("%s: conversion failed", output);
+		return EX_IOERR;
+	}
+
+	printf("%s: %lld bytes%s%s\n", output, (long long)(out_offset + s.size),
+		to_2mg ? ", .2mg header" : "",
+		reordering ? (to_dos ? ", DOS order" : ", ProDOS order") : "");
+	return EX_OK;
+}
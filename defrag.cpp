@@ -0,0 +1,350 @@
+
+#include <sysexits.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ii-part.h"
+#include "prodos.h"
+
+/*
+ * --defragment=NAME: make every file in a ProDOS volume contiguous.
+ *
+ * Fragmented files are moved in directory order, each to the first free run
+ * that holds it. When free space is too broken up for one, contiguous files
+ * are slid down to make room: the lowest hole is filled with the largest
+ * file above it that fits, until the run is there or nothing can move. A
+ * file is laid out as its storage order: index block, then the data it
+ * points to.
+ *
+ * Only standard files move. Directories stay where they are (moving one
+ * means rewriting the header pointer of every entry in it and the parent
+ * pointer of every subdirectory under it), as do extended and Pascal files,
+ * so they can still split the free space; a file that doesn't fit between
+ * them is skipped. A move never overlaps the file's old blocks, since the
+ * original has to survive until its entry points at the copy.
+ *
+ * Each move is ordered so a crash never leaves a reachable block marked
+ * free; at worst the copy or the original is leaked:
+ *   1. copy the blocks (index blocks rewritten) to the new run, fsync
+ *   2. mark the new run used in the bitmap, fsync
+ *   3. point the directory entry at the new key block, fsync
+ *   4. mark the old blocks free, fsync
+ */
+
+namespace {
+
+struct candidate
+{
+	const prodos_file *f;
+	std::vector<unsigned> blocks; // storage order
+	unsigned extents;
+	unsigned key; // moves as the file does
+};
+
+struct read_request
+{
+	unsigned block;
+	unsigned position;
+};
+
+struct defragmenter
+{
+	prodos_volume v;
+	std::vector<unsigned char> bitmap;
+
+	bool is_free(unsigned block) const
+	{
+		return bitmap[block >> 3] & (0x80 >> (block & 7));
+	}
+
+	void set_free(unsigned block, bool free)
+	{
+		if (free) bitmap[block >> 3] |= 0x80 >> (block & 7);
+		else bitmap[block >> 3] &= ~(0x80 >> (block & 7));
+	}
+
+	bool sync() const
+	{
+		return fsync(v.fd) == 0;
+	}
+
+	bool write_bitmap() const
+	{
+		return v.write(v.bitmap_pointer, v.bitmap_blocks(), bitmap.data()) && sync();
+	}
+
+	// first fit. returns 0 (never free) if nothing is large enough.
+	unsigned find_run(unsigned count) const
+	{
+		unsigned run = 0;
+		for (unsigned block = 0; block < v.total_blocks; ++block) {
+			if (!is_free(block)) {
+				run = 0;
+				continue;
+			}
+			if (++run == count) return block + 1 - count;
+		}
+		return 0;
+	}
+
+	static void relocate(unsigned char *index, const std::unordered_map<unsigned, unsigned> &map)
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			unsigned block = index[i] | (index[256 + i] << 8);
+			if (!block) continue;
+			block = map.at(block);
+			index[i] = block & 0xff;
+			index[256 + i] = block >> 8;
+		}
+	}
+
+	bool move(candidate &c, unsigned target)
+	{
+		const prodos_entry &e = c.f->entry;
+		unsigned count = c.blocks.size();
+		std::vector<unsigned char> image(count * 512);
+		std::vector<unsigned char> buffer;
+		std::unordered_map<unsigned, unsigned> map;
+		std::vector<read_request> requests;
+
+		for (unsigned i = 0; i < count; ++i) {
+			map[c.blocks[i]] = target + i;
+			requests.push_back({ c.blocks[i], i });
+		}
+
+		if (!prodos_read_sorted(v, requests, buffer)) return false;
+		for (unsigned i = 0; i < count; ++i)
+			memcpy(&image[requests[i].position * 512], &buffer[i * 512], 512);
+
+		if (e.storage_type == STORAGE_TREE) {
+			unsigned char *master = image.data();
+			for (unsigned i = 0; i < 256; ++i) {
+				unsigned block = master[i] | (master[256 + i] << 8);
+				if (block) relocate(&image[(map.at(block) - target) * 512], map);
+			}
+		}
+		if (e.storage_type != STORAGE_SEEDLING)
+			relocate(image.data(), map);
+
+		// 1.
+		if (!v.write(target, count, image.data()) || !sync()) return false;
+
+		// 2.
+		for (unsigned i = 0; i < count; ++i) set_free(target + i, false);
+		if (!write_bitmap()) return false;
+
+		// 3.
+		unsigned char data[512];
+		if (!v.read(c.f->entry_block, 1, data)) return false;
+		unsigned char *ptr = data + c.f->entry_offset;
+		if (read16(ptr + 0x11) != c.key) {
+			errno = EIO;
+			return false;
+		}
+		ptr[0x11] = target & 0xff;
+		ptr[0x12] = target >> 8;
+		if (!v.write(c.f->entry_block, 1, data) || !sync()) return false;
+
+		// 4.
+		for (unsigned block : c.blocks) set_free(block, true);
+		if (!write_bitmap()) return false;
+
+		for (unsigned i = 0; i < count; ++i) c.blocks[i] = target + i;
+		c.extents = 1;
+		c.key = target;
+		return true;
+	}
+
+	// fills the lowest hole with the largest contiguous file above it that
+	// fits (the highest, of equal ones), so the free space gathers at the
+	// top. 1 if a file moved, 0 if none can, -1 on an error.
+	int slide(const char *name, std::vector<candidate> &list, const candidate &skip, unsigned &moved_blocks)
+	{
+		for (unsigned block = 0; block < v.total_blocks; ) {
+			if (!is_free(block)) {
+				++block;
+				continue;
+			}
+			unsigned start = block;
+			while (block < v.total_blocks && is_free(block)) ++block;
+
+			candidate *best = nullptr;
+			for (auto &c : list) {
+				if (&c == &skip || c.extents != 1 || c.blocks[0] < start || c.blocks.size() > block - start) continue;
+				if (!best || c.blocks.size() > best->blocks.size()
+					|| (c.blocks.size() == best->blocks.size() && c.blocks[0] > best->blocks[0]))
+					best = &c;
+			}
+			if (!best) continue;
+
+			unsigned count = best->blocks.size();
+			if (options.verbose) printf("%s: %u-%u -> %u-%u\n", best->f->path.c_str(), best->blocks[0], best->blocks[0] + count - 1, start, start + count - 1);
+			if (!move(*best, start)) {
+				warn("%s%s", name, best->f->path.c_str());
+				return -1;
+			}
+			moved_blocks += count;
+			return 1;
+		}
+		return 0;
+	}
+};
+
+// every block in use, so a corrupt volume is refused rather than made worse.
+bool in_use(const prodos_volume &v, const std::vector<prodos_file> &list, std::vector<unsigned> &used)
+{
+	std::vector<unsigned> blocks;
+	unsigned char data[512];
+
+	used = { 0, 1 };
+	for (unsigned i = 0; i < v.bitmap_blocks(); ++i) used.push_back(v.bitmap_pointer + i);
+	if (!prodos_directory_blocks(v, 2, blocks)) return false;
+	used.insert(used.end(), blocks.begin(), blocks.end());
+
+	for (const auto &f : list) {
+		const prodos_entry &e = f.entry;
+		switch (e.storage_type) {
+			case STORAGE_SUBDIR:
+				if (!prodos_directory_blocks(v, e.key_pointer, blocks)) return false;
+				break;
+
+			case STORAGE_EXTENDED:
+				if (!v.read(e.key_pointer, 1, data)) return false;
+				used.push_back(e.key_pointer);
+				for (unsigned offset : { 0x000, 0x100 }) {
+					if (!prodos_fork_blocks(v, data[offset], read16(data + offset + 1), blocks)) return false;
+					used.insert(used.end(), blocks.begin(), blocks.end());
+				}
+				continue;
+
+			case STORAGE_PASCAL:
+				blocks.clear();
+				for (unsigned i = 0; i < e.blocks_used; ++i) blocks.push_back(e.key_pointer + i);
+				break;
+
+			default:
+				if (!prodos_fork_blocks(v, e.storage_type, e.key_pointer, blocks)) return false;
+				break;
+		}
+		used.insert(used.end(), blocks.begin(), blocks.end());
+	}
+	return true;
+}
+
+} // namespace
+
+
+int defragment_volume(const char *name)
+{
+	defragmenter d;
+	prodos_volume &v = d.v;
+	std::vector<prodos_file> list;
+	std::vector<unsigned> used;
+	std::vector<candidate> movable; // every standard file
+	std::vector<size_t> candidates; // the fragmented ones, into movable
+	unsigned before = 0;
+	unsigned after = 0;
+	unsigned fragmented = 0;
+	unsigned moved = 0;
+	unsigned moved_blocks = 0;
+	unsigned slid = 0;
+	unsigned skipped = 0;
+
+	auto iter = std::find(files.begin(), files.end(), name);
+	if (iter == files.end()) {
+		warnx("%s: no such partition", name);
+		return EX_USAGE;
+	}
+	if (!v.open(fd, *iter)) {
+		warnx("%s: not a ProDOS volume", name);
+		return EX_DATAERR;
+	}
+	if (v.total_blocks > v.blocks) {
+		warnx("%s: volume is larger than the partition", name);
+		return EX_DATAERR;
+	}
+
+	d.bitmap.resize(v.bitmap_blocks() * 512);
+	if (!v.read(v.bitmap_pointer, v.bitmap_blocks(), d.bitmap.data()) || !prodos_list(v, list) || !in_use(v, list, used)) {
+		warn("%s", name);
+		return EX_IOERR;
+	}
+
+	std::sort(used.begin(), used.end());
+	for (size_t i = 0; i < used.size(); ++i) {
+		if (used[i] >= v.total_blocks || d.is_free(used[i]) || (i && used[i] == used[i - 1])) {
+			warnx("%s: volume is damaged; run --check", name);
+			return EX_DATAERR;
+		}
+	}
+
+	for (const auto &f : list) {
+		std::vector<unsigned> blocks;
+		unsigned extents;
+
+		switch (f.entry.storage_type) {
+			case STORAGE_SUBDIR:
+				prodos_directory_blocks(v, f.entry.key_pointer, blocks);
+				extents = prodos_extents(blocks);
+				before += extents;
+				after += extents;
+				continue;
+
+			case STORAGE_SEEDLING:
+			case STORAGE_SAPLING:
+			case STORAGE_TREE:
+				prodos_fork_blocks(v, f.entry.storage_type, f.entry.key_pointer, blocks);
+				extents = prodos_extents(blocks);
+				before += extents;
+				if (extents > 1) candidates.push_back(movable.size());
+				else after += extents;
+				movable.push_back({ &f, std::move(blocks), extents, f.entry.key_pointer });
+				continue;
+
+			default:
+				// extended and pascal files are left alone.
+				++before;
+				++after;
+				continue;
+		}
+	}
+
+	for (size_t index : candidates) {
+		candidate &c = movable[index];
+		unsigned target = d.find_run(c.blocks.size());
+		++fragmented;
+		while (!target) {
+			int r = d.slide(name, movable, c, moved_blocks);
+			if (r < 0) return EX_IOERR;
+			if (!r) break;
+			++slid;
+			target = d.find_run(c.blocks.size());
+		}
+		if (!target) {
+			if (options.verbose) printf("%s: %u extents, no room\n", c.f->path.c_str(), c.extents);
+			after += c.extents;
+			++skipped;
+			continue;
+		}
+		if (options.verbose) printf("%s: %u extents -> %u-%u\n", c.f->path.c_str(), c.extents, target, target + (unsigned)c.blocks.size() - 1);
+		if (!d.move(c, target)) {
+			warn("%s%s", name, c.f->path.c_str());
+			return EX_IOERR;
+		}
+		++moved;
+		moved_blocks += c.blocks.size();
+		++after;
+	}
+
+	printf("%s: %u fragmented files, %u moved, %u slid down to make room (%u blocks); %u skipped; %u extents before, %u after\n",
+		name, fragmented, moved, slid, moved_blocks, skipped, before, after);
+	return EX_OK;
+}
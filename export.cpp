@@ -0,0 +1,131 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+#include "ii-part.h"
+
+/*
+ * --export=DIR: copy partitions to DIR/NAME.po as sparse files.
+ *
+ * Each partition is read 1 MiB at a time and tested for zeros a block at a
+ * time; only runs of non-zero blocks are written, and the file is extended
+ * to the partition size at the end, so zero runs (including a zero tail)
+ * become holes. The output is truncated first, so nothing stale is left
+ * where a hole should be.
+ */
+
+namespace {
+
+const size_t chunk_size = 1 << 20;
+
+// 8 bytes at a time, or'ed together; compilers vectorize this.
+bool is_zero(const unsigned char *data, size_t size)
+{
+	uint64_t acc = 0;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t x;
+		memcpy(&x, data + i, 8);
+		acc |= x;
+	}
+	return acc == 0;
+}
+
+bool export_one(const file_info &f, const std::string &path, off_t &written)
+{
+	int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) return false;
+
+	std::vector<unsigned char> buffer(chunk_size);
+	written = 0;
+
+	for (off_t offset = 0; offset < f.size; ) {
+		size_t size = std::min<off_t>(chunk_size, f.size - offset);
+		ssize_t ok = cache_pread(fd, buffer.data(), size, f.start + offset);
+		if (ok != (ssize_t)size) {
+			if (ok >= 0) errno = EIO;
+			close(out);
+			return false;
+		}
+
+		// write each run of non-zero blocks; seek over the rest.
+		for (size_t i = 0; i < size; ) {
+			if (is_zero(&buffer[i], 512)) {
+				i += 512;
+				continue;
+			}
+			size_t j = i + 512;
+			while (j < size && !is_zero(&buffer[j], 512)) j += 512;
+
+			if (pwrite(out, &buffer[i], j - i, offset + i) != (ssize_t)(j - i)) {
+				close(out);
+				return false;
+			}
+			written += j - i;
+			i = j;
+		}
+		offset += size;
+	}
+
+	bool rv = ftruncate(out, f.size) == 0 && fsync(out) == 0;
+	rv = close(out) == 0 && rv;
+	return rv;
+}
+
+} // namespace
+
+
+int export_partitions(const char *dir, const std::vector<const char *> &names)
+{
+	std::vector<const file_info *> list;
+
+	for (const char *name : names) {
+		auto iter = std::find(files.begin(), files.end(), name);
+		if (iter == files.end()) {
+			warnx("%s: no such partition", name);
+			return EX_USAGE;
+		}
+		list.push_back(&*iter);
+	}
+	if (names.empty()) {
+		for (const auto &f : files) list.push_back(&f);
+	}
+
+	off_t total = 0;
+	off_t total_written = 0;
+	off_t total_allocated = 0;
+	for (const file_info *f : list) {
+		std::string path = std::string(dir) + "/" + f->name + ".po";
+		off_t written;
+
+		if (!export_one(*f, path, written)) {
+			warn("%s", path.c_str());
+			return EX_IOERR;
+		}
+
+		struct stat st;
+		off_t allocated = stat(path.c_str(), &st) == 0 ? (off_t)st.st_blocks * 512 : written;
+		printf("%s: %lld bytes, %lld written, %lld allocated\n", path.c_str(),
+			(long long)f->size, (long long)written, (long long)allocated);
+
+		total += f->size;
+		total_written += written;
+		total_allocated += allocated;
+	}
+
+	if (list.size() > 1) {
+		printf("total: %lld bytes, %lld written (%.1f%%), %lld allocated\n",
+			(long long)total, (long long)total_written,
+			total ? total_written * 100.0 / total : 0.0, (long long)total_allocated);
+	}
+	return EX_OK;
+}
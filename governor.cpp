@@ -0,0 +1,143 @@
+#include <err.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "governor.h"
+#include "ii-part.h"
+
+/*
+ * Pressure is the "some" avg10 figure from /proc/pressure/memory: the share
+ * of the last ten seconds in which something waited for memory. Above
+ * high_pressure the budget drops by a quarter; below low_pressure it grows
+ * by an eighth, checked once a second, so it backs off quickly and creeps
+ * back.
+ */
+
+namespace {
+
+const int high_pressure = 1000; // 10%
+const int low_pressure = 100; // 1%
+
+struct governor_state
+{
+	std::mutex mutex;
+	std::vector<governed *> list;
+	size_t budget = 0;
+	size_t configured = 0;
+	std::atomic<int> pressure{-1};
+};
+
+// never destroyed: the polling thread may still be using it at exit.
+governor_state &gov = *new governor_state;
+
+int read_pressure()
+{
+	FILE *fp = fopen("/proc/pressure/memory", "r");
+	if (!fp) return -1;
+
+	double avg10;
+	int ok = fscanf(fp, "some avg10=%lf", &avg10);
+	fclose(fp);
+	return ok == 1 ? (int)(avg10 * 100) : -1;
+}
+
+size_t floor_of(size_t size)
+{
+	return size / 8;
+}
+
+// caller holds the mutex. returns the caches whose limit changed.
+std::vector<governed *> apply_budget()
+{
+	std::vector<governed *> changed;
+
+	for (governed *g : gov.list) {
+		size_t limit = (size_t)((double)g->size * gov.budget / gov.configured);
+		limit = std::max(std::min(limit, g->size), floor_of(g->size));
+		if (limit != g->limit.exchange(limit)) changed.push_back(g);
+	}
+	return changed;
+}
+
+void resize(const std::vector<governed *> &changed)
+{
+	for (governed *g : changed) {
+		if (g->resize) g->resize();
+	}
+}
+
+void poll()
+{
+	for (;;) {
+		sleep(1);
+
+		int p = read_pressure();
+		gov.pressure = p;
+		if (p < 0) continue;
+
+		std::vector<governed *> changed;
+		{
+			std::lock_guard<std::mutex> lock(gov.mutex);
+			size_t top = std::min((size_t)options.memory << 20, gov.configured);
+			size_t bottom = 0;
+			for (governed *g : gov.list) bottom += floor_of(g->size);
+
+			size_t b = gov.budget;
+			if (p > high_pressure) b = std::max(b - b / 4, bottom);
+			else if (p < low_pressure) b = std::min(b + std::max(b / 8, (size_t)1 << 20), top);
+			if (b == gov.budget) continue;
+
+			gov.budget = b;
+			changed = apply_budget();
+		}
+		resize(changed);
+	}
+}
+
+} // namespace
+
+
+bool governor_enabled()
+{
+	return options.memory != 0;
+}
+
+void governor_add(governed &g)
+{
+	if (!governor_enabled()) return;
+
+	std::vector<governed *> changed;
+	{
+		std::lock_guard<std::mutex> lock(gov.mutex);
+		gov.list.push_back(&g);
+		gov.configured += g.size;
+		gov.budget = std::min((size_t)options.memory << 20, gov.configured);
+		changed = apply_budget();
+	}
+	resize(changed);
+}
+
+void governor_start()
+{
+	if (!governor_enabled()) return;
+
+	gov.pressure = read_pressure();
+	if (gov.pressure < 0) warnx("-omemory: no memory pressure information; the budget is fixed");
+	else std::thread(poll).detach();
+}
+
+void governor_get_stats(memory_stats &stats)
+{
+	std::lock_guard<std::mutex> lock(gov.mutex);
+
+	stats = memory_stats();
+	stats.budget = gov.budget;
+	stats.configured = gov.configured;
+	for (const governed *g : gov.list) stats.used += g->used.load(std::memory_order_relaxed);
+	stats.pressure = gov.pressure;
+}
@@ -0,0 +1,50 @@
+#ifndef governor_h
+#define governor_h
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Memory governor, for -omemory=N.
+ *
+ * Each cache registers with its configured size. The governor keeps a
+ * budget of at most N MiB for all of them together and hands each cache a
+ * limit in proportion to its size, but never below an eighth of it. The
+ * budget shrinks while the kernel reports memory pressure (Linux PSI) and
+ * grows back once it's gone. Owners evict down to their limit as they add
+ * things; resize is called whenever a limit changes, so they can evict
+ * right away (and update used).
+ *
+ * Without -omemory nothing is registered and every limit stays at the
+ * configured size.
+ */
+
+struct governed
+{
+	const char *name;
+	size_t size; // configured; the most it will ever get
+	void (*resize)();
+	std::atomic<size_t> limit;
+	std::atomic<size_t> used{0};
+
+	governed(const char *name, size_t size, void (*resize)())
+		: name(name), size(size), resize(resize), limit(size) {}
+};
+
+struct memory_stats
+{
+	size_t budget = 0;
+	size_t used = 0;
+	size_t configured = 0;
+	int pressure = -1; // PSI "some" avg10, in hundredths of a percent; -1 if unavailable
+};
+
+bool governor_enabled();
+void governor_add(governed &g);
+
+// starts the thread that polls for pressure; called from init.
+void governor_start();
+
+void governor_get_stats(memory_stats &stats);
+
+#endif
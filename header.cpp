@@ -0,0 +1,265 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ii-part.h"
+
+/*
+ * Partition headers: reading them at mount time and writing them when
+ * building or repartitioning an image. The writers produce exactly what
+ * the parsers read.
+ *
+ * Focus / Zip: blocks 0-2. Block 0 has a 15-byte signature, the partition
+ * count at byte 15 and (start, count) pairs from 0x20. The names follow in
+ * blocks 1 and 2, 32 bytes each, from 0x220.
+ *
+ * MicroDrive: block 0. Two drives of up to 8 partitions; the first data
+ * block is 256.
+ *
+ * 2IMG: not a partition header, but the wrapper on single volumes (.2mg);
+ * 64 bytes, with the format, data offset and data length.
+ */
+
+bool is_microdrive(const unsigned char *data)
+{
+	return data[0] == 0xca && data[1] == 0xcc && read32(data + 0x20) == 256;
+}
+
+void parse_microdrive(const unsigned char *data, std::vector<file_info> &out)
+{
+	if (options.verbose) {
+		fputs("Found MicroDrive partition\n", stdout);
+	}
+
+	int pcount;
+
+	pcount = std::min<int>(data[0x0c], MICRODRIVE_MAX);
+	for (int i = 0; i < pcount; ++i) {
+
+		struct file_info f;
+		std::string name;
+
+		name = std::string("MicroDrive1-") + std::to_string(i + 1);
+		unsigned start = read32(data + 0x20 + i * 4);
+		unsigned count = read24(data + 0x40 + i * 4);
+
+		if (options.verbose) {
+			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
+		}
+
+		f.start = start * 512;
+		f.size = count * 512;
+		f.name = std::move(name);
+		out.emplace_back(std::move(f));
+	}
+
+
+	pcount = std::min<int>(data[0x0d], MICRODRIVE_MAX);
+	for (int i = 0; i < pcount; ++i) {
+
+		struct file_info f;
+		std::string name;
+
+		name = std::string("MicroDrive2-") + std::to_string(i + 1);
+		unsigned start = read32(data + 0x80 + i * 4);
+		unsigned count = read24(data + 0xa0 + i * 4);
+
+		if (options.verbose) {
+			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
+		}
+
+		f.start = start * 512;
+		f.size = count * 512;
+		f.name = std::move(name);
+		out.emplace_back(std::move(f));
+	}
+}
+
+
+bool is_focus(const unsigned char *data)
+{
+	return !memcmp(data, "Parsons Engin.", 15);
+}
+
+bool is_zip(const unsigned char *data)
+{
+	return !memcmp(data, "Zip Technolog.", 15);
+}
+
+void parse_focus(const unsigned char *data, std::vector<file_info> &out)
+{
+
+	if (options.verbose) {
+		fputs("Found focus/zip partition\n", stdout);
+	}
+
+	int pcount = std::min<int>(data[15], FOCUS_MAX);
+
+	const unsigned char *name_ptr = data + 512 + 0x20;
+	const unsigned char *size_ptr = data + 0x20;
+	for (int i = 0; i < pcount; ++i)
+	{
+		struct file_info f;
+
+		std::string name(name_ptr, name_ptr + 0x20);
+		while (!name.empty() && name.back() == 0x00) name.pop_back();
+
+		unsigned start = read32(size_ptr + 0);
+		unsigned count = read32(size_ptr + 4);
+
+		if (options.verbose) {
+			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
+		}
+
+		f.name = std::move(name);
+		f.start =  start * 512;
+		f.size = count * 512;
+
+		out.emplace_back(std::move(f));
+
+		name_ptr += 0x20;
+		size_ptr += 0x10;
+	}
+}
+
+#if 0
+static bool is_vulcan(const unsigned char *data)
+{
+	return data[0] == 0xae && data[1] == 0xae;
+}
+// untested / unconfirmed
+static void parse_vulcan(const unsigned char *data)
+{
+	unsigned start = 1;
+	data += 0x100;
+	for (unsigned i = 0; i < 15; ++i, data += 16) {
+		int flags = data[6];
+		unsigned count = read16(data + 3);
+		if (flags & 0x20) {
+			char tmp[10];
+			std::transform(data + 7, data + 16, tmp, [](uint8t_t c){ return c & 0x7f });
+
+			std::string name(tmp, tmp+10);
+			while (!name.empty() && name.back() == 0x00) name.pop_back();
+
+			struct file_info f;
+			f.name = std::move(name);
+			f.start = start * 512;
+			f.size = count * 512;
+		}
+		start += count;
+	}
+}
+#endif
+
+
+bool make_focus_header(const std::vector<file_info> &parts, bool zip, std::vector<unsigned char> &header)
+{
+	if (parts.size() > FOCUS_MAX) return false;
+
+	header.assign(FOCUS_HEADER_BLOCKS * 512, 0);
+	memcpy(header.data(), zip ? "Zip Technolog." : "Parsons Engin.", 15);
+	header[15] = parts.size();
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		const file_info &f = parts[i];
+		if ((f.start | f.size) & 511) return false;
+		if (f.start / 512 > 0xffffffff || f.size / 512 > 0xffffffff) return false;
+
+		write32(&header[0x20 + i * 16 + 0], f.start / 512);
+		write32(&header[0x20 + i * 16 + 4], f.size / 512);
+		memcpy(&header[512 + 0x20 + i * 32], f.name.data(), std::min<size_t>(f.name.size(), 32));
+	}
+	return true;
+}
+
+// partitions named MicroDrive2-* go on the second drive, the rest on the first.
+bool make_microdrive_header(const std::vector<file_info> &parts, std::vector<unsigned char> &header)
+{
+	unsigned count[2] = { 0, 0 };
+
+	header.assign(512, 0);
+	header[0] = 0xca;
+	header[1] = 0xcc;
+
+	for (const auto &f : parts) {
+		unsigned drive = f.name.compare(0, 12, "MicroDrive2-") == 0;
+		unsigned i = count[drive]++;
+
+		if (i >= MICRODRIVE_MAX) return false;
+		if ((f.start | f.size) & 511) return false;
+		if (f.start / 512 > 0xffffffff || f.size / 512 > 0xffffff) return false;
+
+		write32(&header[(drive ? 0x80 : 0x20) + i * 4], f.start / 512);
+		write24(&header[(drive ? 0xa0 : 0x40) + i * 4], f.size / 512);
+	}
+	header[0x0c] = count[0];
+	header[0x0d] = count[1];
+
+	// is_microdrive() wants the first partition at block 256.
+	return count[0] && read32(&header[0x20]) == MICRODRIVE_FIRST_BLOCK;
+}
+
+bool parse_2mg(const unsigned char *data, off_t file_size, off_t &offset, off_t &size, unsigned &format)
+{
+	if (memcmp(data, "2IMG", 4)) return false;
+
+	format = read32(data + 0x0c);
+	offset = read32(data + 0x18);
+	size = read32(data + 0x1c);
+	if (!size) size = (off_t)read32(data + 0x14) * 512;
+	return offset + size <= file_size;
+}
+
+std::vector<unsigned char> make_2mg_header(off_t size, bool locked)
+{
+	std::vector<unsigned char> h(64, 0);
+
+	memcpy(&h[0x00], "2IMG", 4);
+	memcpy(&h[0x04], "IIPF", 4); // creator
+	write16(&h[0x08], h.size());
+	write16(&h[0x0a], 1); // version
+	write32(&h[0x0c], IMG_PRODOS_ORDER);
+	write32(&h[0x10], locked ? 0x80000000 : 0);
+	write32(&h[0x14], size / 512);
+	write32(&h[0x18], h.size());
+	write32(&h[0x1c], size);
+	return h;
+}
+
+// rewrites the start and size of every partition in an existing header
+// (parts in the order the parser returned them), leaving the rest alone.
+bool patch_header(unsigned char *data, const std::vector<file_info> &parts)
+{
+	for (const auto &f : parts) {
+		if ((f.start | f.size) & 511) return false;
+		if (f.start / 512 > 0xffffffff || f.size / 512 > 0xffffffff) return false;
+	}
+
+	if (is_focus(data) || is_zip(data)) {
+		if (parts.size() != std::min<size_t>(data[15], FOCUS_MAX)) return false;
+		for (size_t i = 0; i < parts.size(); ++i) {
+			write32(data + 0x20 + i * 16 + 0, parts[i].start / 512);
+			write32(data + 0x20 + i * 16 + 4, parts[i].size / 512);
+		}
+		return true;
+	}
+
+	if (is_microdrive(data)) {
+		unsigned count[2] = { 0, 0 };
+		for (const auto &f : parts) {
+			unsigned drive = f.name.compare(0, 12, "MicroDrive2-") == 0;
+			unsigned i = count[drive]++;
+			if (i >= MICRODRIVE_MAX || f.size / 512 > 0xffffff) return false;
+			write32(data + (drive ? 0x80 : 0x20) + i * 4, f.start / 512);
+			write24(data + (drive ? 0xa0 : 0x40) + i * 4, f.size / 512);
+		}
+		return count[0] == std::min<unsigned>(data[0x0c], MICRODRIVE_MAX)
+			&& count[1] == std::min<unsigned>(data[0x0d], MICRODRIVE_MAX)
+			&& read32(data + 0x20) == MICRODRIVE_FIRST_BLOCK;
+	}
+	return false;
+}
@@ -0,0 +1,253 @@
+#ifndef ii_part_h
+#define ii_part_h
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct fuse_bufvec;
+struct fuse_operations;
+
+struct options
+{
+	const char *filename = nullptr;
+	const char *mountpoint = nullptr;
+	// should be int, not bool, to work with OPTION()
+	int verbose = false;
+	int rw = false;
+	unsigned cache = 0; // MiB
+	unsigned memory = 0; // MiB, for all caches together; 0 for fixed sizes
+	unsigned split = 0; // KiB; 0 to issue requests whole
+	unsigned depth = 4; // pieces in flight, with split
+	int shared_cache = false;
+	int check = false;
+	const char *defragment = nullptr; // partition name
+	const char *build = nullptr; // scheme
+	const char *repartition = nullptr; // NAME:BLOCKS,...
+	int library = false;
+	unsigned max_fds = 64; // --library
+	const char *index = nullptr; // --library
+	const char *catalog = nullptr; // index file
+	const char *find = nullptr;
+	unsigned jobs = 8; // --catalog
+	int nufx = false;
+	const char *parent = nullptr; // CHD
+	const char *containers = nullptr; // 2mg:hdv:po
+	const char *export_dir = nullptr;
+	const char *scrub = nullptr; // sidecar
+	unsigned scrub_rate = 8; // MiB/s
+	const char *convert = nullptr; // output
+	const char *slow = nullptr; // PROFILE:KEY=N...
+	unsigned serve = 0; // port
+	std::vector<const char *> inputs; // volumes for --build, partitions for --export, --convert
+};
+
+extern struct options options;
+
+struct file_info
+{
+	std::string name;
+	off_t start;
+	off_t size;
+	std::string volume;
+
+	// bumped when the backing store changes underneath us.
+	// protected by generation_mutex.
+	unsigned generation = 0;
+	unsigned cached_generation = ~0u;
+
+	// precomputed extended attributes (name, value)
+	std::vector<std::pair<std::string, std::string>> xattrs;
+
+	bool operator==(const char *s)
+	{
+		return !strcmp(name.c_str(), s);
+	}
+	bool operator==(const std::string &s)
+	{
+		return name == s;
+	}
+};
+
+extern std::vector<file_info> files;
+extern int fd;
+extern off_t total_blocks;
+extern const char *scheme;
+extern std::mutex generation_mutex;
+
+struct stat;
+
+off_t file_size(int fd);
+uint64_t mtime_ns(const struct stat &st);
+// a reply for read_buf: the prefix, then device bytes. nullptr (and errno) on failure.
+struct fuse_bufvec *device_bufvec(const void *prefix, size_t prefix_size, off_t offset, size_t size);
+
+// header.cpp
+enum {
+	FOCUS_MAX = 30,
+	FOCUS_HEADER_BLOCKS = 3,
+	MICRODRIVE_MAX = 8, // per drive
+	MICRODRIVE_FIRST_BLOCK = 256,
+};
+
+bool is_focus(const unsigned char *data);
+bool is_zip(const unsigned char *data);
+bool is_microdrive(const unsigned char *data);
+// data is the first FOCUS_HEADER_BLOCKS blocks.
+void parse_focus(const unsigned char *data, std::vector<file_info> &out);
+void parse_microdrive(const unsigned char *data, std::vector<file_info> &out);
+
+bool make_focus_header(const std::vector<file_info> &parts, bool zip, std::vector<unsigned char> &header);
+bool make_microdrive_header(const std::vector<file_info> &parts, std::vector<unsigned char> &header);
+bool patch_header(unsigned char *data, const std::vector<file_info> &parts);
+
+enum {
+	IMG_DOS_ORDER = 0,
+	IMG_PRODOS_ORDER = 1,
+	IMG_NIBBLE = 2,
+};
+
+// data is the first 64 bytes. false if it isn't a .2mg header or the data
+// runs past the end of the file.
+bool parse_2mg(const unsigned char *data, off_t file_size, off_t &offset, off_t &size, unsigned &format);
+std::vector<unsigned char> make_2mg_header(off_t size, bool locked);
+
+// assemble.cpp
+int build_image(const char *kind, const char *output, const std::vector<const char *> &inputs);
+
+// repartition.cpp
+int repartition(const char *spec);
+
+// library.cpp
+int library_setup(const char *path, struct fuse_operations &ops);
+
+// catalog.cpp
+int catalog_build(const char *index, const std::vector<const char *> &inputs);
+int catalog_find(const char *index, const char *term);
+
+// nufx.cpp
+void nufx_setup(struct fuse_operations &ops);
+
+// export.cpp
+int export_partitions(const char *dir, const std::vector<const char *> &names);
+
+// serve.cpp
+int serve_partitions(unsigned port);
+
+// convert.cpp
+int convert_image(const char *output, const char *input, const std::vector<const char *> &names);
+
+// container.cpp
+void container_setup(struct fuse_operations &ops);
+
+// stats.cpp
+struct io_stats
+{
+	uint64_t reads = 0;
+	uint64_t read_bytes = 0;
+	uint64_t writes = 0;
+	uint64_t write_bytes = 0;
+};
+
+// indexes the partition extents; called once files is final.
+void stats_setup();
+// counts an access to [offset, offset + size) of the device against the
+// partitions it covers.
+void stats_account(off_t offset, off_t size, bool write);
+// index is into files; files.size() is everything outside the partitions.
+bool stats_get(size_t index, io_stats &stats);
+// accesses counted so far, to tell when the device is idle.
+uint64_t stats_requests();
+
+// scrub.cpp
+struct scrub_stats
+{
+	bool enabled = false;
+	uint64_t passes = 0;
+	uint64_t blocks = 0;
+	uint64_t mismatches = 0;
+	int64_t last_mismatch = -1; // device block
+};
+
+// maps (or creates) the sidecar; called once files is final.
+bool scrub_setup(const char *path);
+void scrub_start();
+// [offset, offset + size) of the device was written by us.
+void scrub_written(off_t offset, off_t size);
+void scrub_get_stats(scrub_stats &stats);
+
+// slow.cpp
+struct slow_stats
+{
+	bool enabled = false;
+	uint64_t requests = 0;
+	uint64_t errors = 0;
+	uint64_t busy_ns = 0; // simulated
+};
+
+// exits with a message if spec is bad. size is the device's.
+void slow_setup(const char *spec, off_t size);
+bool slow_enabled();
+// waits out an access to [offset, offset + size) of the simulated device.
+// false, with errno EIO, if the access is to fail.
+bool slow_io(off_t offset, size_t size, bool write);
+void slow_get_stats(slow_stats &stats);
+
+// check.cpp
+int check_volumes();
+
+// defrag.cpp
+int defragment_volume(const char *name);
+
+inline uint16_t read16(const unsigned char *data)
+{
+	return data[0] + (data[1] << 8);
+}
+
+inline uint32_t read24(const unsigned char *data)
+{
+	return data[0] + (data[1] << 8) + (data[2] << 16);
+}
+
+inline uint32_t read32(const unsigned char *data)
+{
+	return data[0] + (data[1] << 8) + (data[2] << 16) + (data[3] << 24);
+}
+
+inline void write16(unsigned char *data, uint16_t x)
+{
+	data[0] = x;
+	data[1] = x >> 8;
+}
+
+inline void write24(unsigned char *data, uint32_t x)
+{
+	data[0] = x;
+	data[1] = x >> 8;
+	data[2] = x >> 16;
+}
+
+inline void write32(unsigned char *data, uint32_t x)
+{
+	data[0] = x;
+	data[1] = x >> 8;
+	data[2] = x >> 16;
+	data[3] = x >> 24;
+}
+
+// 64-bit FNV-1a; pass the last result as hash to continue.
+inline uint64_t fnv(const unsigned char *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#endif
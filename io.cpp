@@ -0,0 +1,111 @@
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <thread>
+
+#include "io.h"
+
+/*
+ * The pool behind io_batch: one queue, a few threads. A task is run by
+ * whoever claims it first, a pool thread or the batch's own wait(); the
+ * queue holds a reference, so a task claimed (and its batch gone) before a
+ * pool thread gets to it is just dropped.
+ */
+
+struct io_task
+{
+	std::function<bool()> op;
+	io_batch *batch;
+	std::atomic<bool> claimed{false};
+
+	void run()
+	{
+		if (claimed.exchange(true)) return;
+		errno = 0;
+		bool ok = op();
+		batch->finish(ok, errno);
+	}
+};
+
+namespace {
+
+struct io_queue
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::shared_ptr<io_task>> tasks;
+	bool running = false;
+};
+
+// the threads never exit, so this is never destroyed.
+io_queue &queue = *new io_queue;
+
+void worker()
+{
+	for (;;) {
+		std::shared_ptr<io_task> t;
+		{
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.cv.wait(lock, []{ return !queue.tasks.empty(); });
+			t = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		t->run();
+	}
+}
+
+} // namespace
+
+
+void io_batch::add(std::function<bool()> op)
+{
+	auto t = std::make_shared<io_task>();
+	t->op = std::move(op);
+	t->batch = this;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		++pending;
+	}
+	tasks.push_back(t);
+
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.running) {
+			queue.tasks.push_back(t);
+			queue.cv.notify_one();
+			return;
+		}
+	}
+	t->run();
+}
+
+void io_batch::finish(bool ok, int e)
+{
+	// the waiter may destroy the batch as soon as the lock is released.
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!ok && !error) error = e ? e : EIO;
+	if (--pending == 0) cv.notify_all();
+}
+
+bool io_batch::wait()
+{
+	for (auto &t : tasks) t->run();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [this]{ return pending == 0; });
+	tasks.clear();
+
+	int e = error;
+	error = 0;
+	if (e) errno = e;
+	return !e;
+}
+
+void io_start(unsigned threads)
+{
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.running) return;
+	queue.running = true;
+	for (unsigned i = 0; i < threads; ++i)
+		std::thread(worker).detach();
+}
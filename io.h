@@ -0,0 +1,56 @@
+#ifndef io_h
+#define io_h
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Overlapped device I/O.
+ *
+ * A request that needs several independent device operations (a read that
+ * misses the cache in more than one place, say) adds them to an io_batch
+ * and collects them with wait(). They run on a small pool of threads in the
+ * meantime; wait() runs whatever the pool hasn't started yet on the calling
+ * thread, so the caller works rather than sleeps and a busy pool never holds
+ * a request up.
+ *
+ * C++14 has no coroutines, so this is the whole task model: an operation is
+ * a function, and a request awaits the batch.
+ */
+
+struct io_task;
+
+struct io_batch
+{
+	io_batch() = default;
+	io_batch(const io_batch &) = delete;
+	io_batch &operator=(const io_batch &) = delete;
+	~io_batch() { wait(); }
+
+	// op returns false (and sets errno) on failure. it must not touch the
+	// batch.
+	void add(std::function<bool()> op);
+
+	// true if every operation since the last wait succeeded; otherwise
+	// false, with errno from the first to fail.
+	bool wait();
+
+private:
+	friend struct io_task;
+	void finish(bool ok, int error);
+
+	std::vector<std::shared_ptr<io_task>> tasks;
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned pending = 0;
+	int error = 0;
+};
+
+// starts the threads. threads don't survive fuse_main daemonizing, so this
+// is called from init; until then operations run as they are added.
+void io_start(unsigned threads);
+
+#endif
@@ -0,0 +1,546 @@
+
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define FUSE_USE_VERSION 27
+#include <fuse.h>
+
+#include "ii-part.h"
+
+/*
+ * --library: mount a directory of card images. The root lists the images;
+ * each image is a directory of its partitions, parsed on first access.
+ *
+ * Backing files are opened on demand and kept in a bounded LRU
+ * (-omax_fds=N). A handle in use by a read stays open until the read is
+ * done even if it's evicted meanwhile.
+ *
+ * Partition tables are saved in a sidecar index (.ii-part-index in the
+ * library, or -oindex=PATH) keyed by file size and mtime, so after the first
+ * scan nothing needs to be opened to list the library.
+ */
+
+namespace {
+
+struct image
+{
+	std::string name;
+	std::string path; // under mutex once the image is in images
+	off_t size = 0;
+	uint64_t mtime = 0; // ns
+
+	std::mutex mutex; // protects the rest
+	bool parsed = false;
+	bool valid = false;
+	std::string scheme;
+	std::vector<file_info> parts;
+};
+
+struct backing
+{
+	int fd;
+	backing(int fd) : fd(fd) {}
+	~backing() { close(fd); }
+};
+
+// absolute: fuse_main changes to / when it daemonizes.
+std::string library_path;
+std::string index_path;
+std::atomic<uint64_t> library_mtime(0);
+
+std::mutex images_mutex; // also held across a scan
+std::map<std::string, std::shared_ptr<image>> images;
+std::atomic<bool> index_dirty(false);
+std::mutex save_mutex;
+const unsigned flush_interval = 5; // seconds
+
+std::mutex lru_mutex;
+std::list<std::pair<std::string, std::shared_ptr<backing>>> lru;
+std::unordered_map<std::string, decltype(lru)::iterator> lru_map;
+
+
+// realpath, or (for an index that doesn't exist yet) realpath of the
+// directory it will be in.
+bool absolute_path(const char *path, std::string &out)
+{
+	if (char *rp = realpath(path, nullptr)) {
+		out = rp;
+		free(rp);
+		return true;
+	}
+
+	std::string s = path;
+	size_t slash = s.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : s.substr(0, std::max<size_t>(slash, 1));
+	char *rp = realpath(dir.c_str(), nullptr);
+	if (!rp) return false;
+	out = rp;
+	free(rp);
+	if (out != "/") out += "/";
+	out += s.substr(slash + 1);
+	return true;
+}
+
+std::shared_ptr<backing> get_backing(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(lru_mutex);
+
+	auto iter = lru_map.find(path);
+	if (iter != lru_map.end()) {
+		lru.splice(lru.begin(), lru, iter->second);
+		return iter->second->second;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return nullptr;
+
+	lru.emplace_front(path, std::make_shared<backing>(fd));
+	lru_map[path] = lru.begin();
+	while (lru.size() > std::max(options.max_fds, 1u)) {
+		lru_map.erase(lru.back().first);
+		lru.pop_back();
+	}
+	return lru.front().second;
+}
+
+void forget_backing(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(lru_mutex);
+
+	auto iter = lru_map.find(path);
+	if (iter == lru_map.end()) return;
+	lru.erase(iter->second);
+	lru_map.erase(iter);
+}
+
+// names are escaped so the index stays one record per line.
+std::string escape(const std::string &s)
+{
+	std::string rv;
+	char tmp[4];
+	for (unsigned char c : s) {
+		if (c <= 0x20 || c >= 0x7f || c == '%') {
+			snprintf(tmp, sizeof(tmp), "%%%02x", c);
+			rv += tmp;
+		} else rv.push_back(c);
+	}
+	return rv;
+}
+
+std::string unescape(const std::string &s)
+{
+	std::string rv;
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (s[i] == '%' && i + 2 < s.size()) {
+			rv.push_back(std::stoi(s.substr(i + 1, 2), nullptr, 16));
+			i += 2;
+		} else rv.push_back(s[i]);
+	}
+	return rv;
+}
+
+const char index_magic[] = "ii-part-fuse library 1";
+
+/*
+ * image name size mtime scheme count
+ * part name start size
+ * ...
+ */
+void load_index(std::map<std::string, std::shared_ptr<image>> &out)
+{
+	FILE *fp = fopen(index_path.c_str(), "r");
+	if (!fp) return;
+
+	char line[1024];
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, index_magic, strlen(index_magic))) {
+		fclose(fp);
+		return;
+	}
+
+	std::shared_ptr<image> img;
+	while (fgets(line, sizeof(line), fp)) {
+		char name[512], scheme[32];
+		long long size, start;
+		unsigned long long mtime;
+		unsigned count;
+
+		if (sscanf(line, "image %511s %lld %llu %31s %u", name, &size, &mtime, scheme, &count) == 5) {
+			img = std::make_shared<image>();
+			img->name = unescape(name);
+			img->size = size;
+			img->mtime = mtime;
+			img->parsed = true;
+			img->valid = strcmp(scheme, "-");
+			if (img->valid) img->scheme = scheme;
+			out[img->name] = img;
+			continue;
+		}
+		if (img && sscanf(line, "part %511s %lld %lld", name, &start, &size) == 3) {
+			file_info f;
+			f.name = unescape(name);
+			f.start = start;
+			f.size = size;
+			img->parts.push_back(std::move(f));
+		}
+	}
+	fclose(fp);
+}
+
+// the text is built from a snapshot, so readdir and friends only wait for
+// the list to be copied. save_mutex keeps the flusher and destroy off each
+// other's .tmp.
+void save_index()
+{
+	std::lock_guard<std::mutex> lock(save_mutex);
+	index_dirty = false;
+
+	std::vector<std::shared_ptr<image>> list;
+	{
+		std::lock_guard<std::mutex> lock2(images_mutex);
+		for (const auto &kv : images) list.push_back(kv.second);
+	}
+
+	std::string text = index_magic;
+	text += "\n";
+	char line[1024];
+	for (const auto &p : list) {
+		image &img = *p;
+		std::lock_guard<std::mutex> lock2(img.mutex);
+		if (!img.parsed) continue;
+
+		snprintf(line, sizeof(line), "image %s %lld %llu %s %zu\n", escape(img.name).c_str(), (long long)img.size,
+			(unsigned long long)img.mtime, img.valid ? img.scheme.c_str() : "-", img.parts.size());
+		text += line;
+		for (const auto &f : img.parts) {
+			snprintf(line, sizeof(line), "part %s %lld %lld\n", escape(f.name).c_str(), (long long)f.start, (long long)f.size);
+			text += line;
+		}
+	}
+
+	std::string tmp = index_path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) {
+		index_dirty = true;
+		return;
+	}
+	fwrite(text.data(), 1, text.size(), fp);
+	if (fclose(fp) == 0) rename(tmp.c_str(), index_path.c_str());
+	else unlink(tmp.c_str());
+}
+
+// saves the index every flush_interval seconds while there's news, so a
+// walk of the whole library is a handful of writes rather than one a parse,
+// and a mount that's killed loses at most the last few seconds.
+void flush_index()
+{
+	for (;;) {
+		sleep(flush_interval);
+		if (index_dirty) save_index();
+	}
+}
+
+// read the partition table, if it hasn't been read (or loaded from the index).
+bool parse(image &img)
+{
+	bool valid = false;
+	{
+		std::lock_guard<std::mutex> lock(img.mutex);
+		if (img.parsed) return img.valid;
+
+		unsigned char buffer[512 * FOCUS_HEADER_BLOCKS];
+		auto b = get_backing(img.path);
+		if (b && pread(b->fd, buffer, sizeof(buffer), 0) == sizeof(buffer)) {
+			if (is_focus(buffer) || is_zip(buffer)) {
+				img.scheme = is_zip(buffer) ? "zip" : "focus";
+				parse_focus(buffer, img.parts);
+				valid = true;
+			} else if (is_microdrive(buffer)) {
+				img.scheme = "microdrive";
+				parse_microdrive(buffer, img.parts);
+				valid = true;
+			}
+		}
+		img.parsed = true;
+		img.valid = valid;
+	}
+
+	index_dirty = true;
+	return valid;
+}
+
+
+// (re)read the directory, keeping what's known about unchanged images. runs
+// under images_mutex, as reads may be using the images meanwhile.
+void scan()
+{
+	{
+		std::lock_guard<std::mutex> lock(images_mutex);
+		std::map<std::string, std::shared_ptr<image>> known = images;
+		struct stat st;
+
+		if (known.empty()) load_index(known);
+
+		if (stat(library_path.c_str(), &st) == 0) library_mtime = mtime_ns(st);
+
+		std::map<std::string, std::shared_ptr<image>> found;
+		bool changed = false;
+		DIR *dp = opendir(library_path.c_str());
+		if (dp) {
+			while (struct dirent *d = readdir(dp)) {
+				if (d->d_name[0] == '.') continue;
+
+				std::string path = library_path + "/" + d->d_name;
+				if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) continue;
+				if (st.st_size < 512 * FOCUS_HEADER_BLOCKS || (st.st_size & 511)) continue;
+
+				auto iter = known.find(d->d_name);
+				if (iter != known.end() && iter->second->size == st.st_size && iter->second->mtime == mtime_ns(st)) {
+					std::lock_guard<std::mutex> lock2(iter->second->mutex);
+					iter->second->path = path;
+					found[d->d_name] = iter->second;
+					continue;
+				}
+				if (iter != known.end()) forget_backing(path);
+
+				auto img = std::make_shared<image>();
+				img->name = d->d_name;
+				img->path = path;
+				img->size = st.st_size;
+				img->mtime = mtime_ns(st);
+				found[d->d_name] = img;
+				changed = true;
+			}
+			closedir(dp);
+		}
+		if (found.size() != known.size()) changed = true;
+
+		images.swap(found);
+		if (changed) index_dirty = true;
+	}
+}
+
+std::shared_ptr<image> find_image(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(images_mutex);
+	auto iter = images.find(name);
+	if (iter == images.end()) return nullptr;
+	return iter->second;
+}
+
+// "/image/partition" -> image, partition (either may be empty).
+void split(const char *path, std::string &a, std::string &b)
+{
+	const char *cp = strchr(path + 1, '/');
+	if (!cp) {
+		a = path + 1;
+		b.clear();
+	} else {
+		a.assign(path + 1, cp);
+		b = cp + 1;
+	}
+}
+
+const file_info *find_part(const image &img, const std::string &name)
+{
+	for (const auto &f : img.parts)
+		if (f.name == name) return &f;
+	return nullptr;
+}
+
+
+int library_getattr(const char *path, struct stat *stbuf)
+{
+	std::string a, b;
+	split(path, a, b);
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	if (a.empty()) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	auto img = find_image(a);
+	if (!img) return -ENOENT;
+
+	stbuf->st_mtime = img->mtime / 1000000000;
+	stbuf->st_ctime = stbuf->st_mtime;
+	if (b.empty()) {
+		// don't parse here; ls -l of the root would open every image.
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	if (!parse(*img)) return -ENOENT;
+	std::lock_guard<std::mutex> lock(img->mutex);
+	const file_info *f = find_part(*img, b);
+	if (!f) return -ENOENT;
+
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = f->size;
+	stbuf->st_blocks = f->size / 512;
+	return 0;
+}
+
+int library_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	std::string a, b;
+	split(path, a, b);
+	if (!b.empty()) return -ENOENT;
+
+	if (a.empty()) {
+		struct stat st;
+		if (stat(library_path.c_str(), &st) == 0 && mtime_ns(st) != library_mtime) scan();
+
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		std::lock_guard<std::mutex> lock(images_mutex);
+		for (const auto &kv : images) {
+			// hide files known not to be card images.
+			image &img = *kv.second;
+			std::unique_lock<std::mutex> lock2(img.mutex, std::try_to_lock);
+			if (lock2 && img.parsed && !img.valid) continue;
+			filler(buf, kv.first.c_str(), NULL, 0);
+		}
+		return 0;
+	}
+
+	auto img = find_image(a);
+	if (!img) return -ENOENT;
+	parse(*img);
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	std::lock_guard<std::mutex> lock(img->mutex);
+	for (const auto &f : img->parts)
+		filler(buf, f.name.c_str(), NULL, 0);
+	return 0;
+}
+
+int library_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int rv = library_getattr(path, &st);
+	if (rv) return rv;
+	if (!S_ISREG(st.st_mode)) return -EISDIR;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+int library_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	std::string a, b;
+	split(path, a, b);
+
+	auto img = find_image(a);
+	if (!img || !parse(*img)) return -ENOENT;
+
+	off_t start, length;
+	std::string backing_path;
+	{
+		std::lock_guard<std::mutex> lock(img->mutex);
+		const file_info *f = find_part(*img, b);
+		if (!f) return -ENOENT;
+		start = f->start;
+		length = f->size;
+		backing_path = img->path;
+	}
+
+	if (offset >= length) return 0;
+	size = std::min<off_t>(size, length - offset);
+
+	auto back = get_backing(backing_path);
+	if (!back) return -errno;
+
+	ssize_t ok = pread(back->fd, buf, size, start + offset);
+	if (ok < 0) return -errno;
+	return ok;
+}
+
+int library_statfs(const char *path, struct statvfs *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+
+	std::lock_guard<std::mutex> lock(images_mutex);
+	stbuf->f_bsize = 512;
+	stbuf->f_frsize = 512;
+	for (const auto &kv : images)
+		stbuf->f_blocks += kv.second->size / 512;
+	stbuf->f_files = images.size();
+	stbuf->f_flag = ST_NOSUID | ST_RDONLY;
+	return 0;
+}
+
+// fuse_main has daemonized by now, so the thread survives.
+void *library_init(struct fuse_conn_info *)
+{
+	std::thread(flush_index).detach();
+	return nullptr;
+}
+
+void library_destroy(void *)
+{
+	if (index_dirty) save_index();
+}
+
+} // namespace
+
+
+int library_setup(const char *path, struct fuse_operations &ops)
+{
+	struct stat st;
+
+	if (options.rw) {
+		warnx("--library mounts are read-only");
+		return -1;
+	}
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		warnx("%s: not a directory", path);
+		return -1;
+	}
+
+	if (!absolute_path(path, library_path)) {
+		warn("%s", path);
+		return -1;
+	}
+	if (!options.index) index_path = library_path + "/.ii-part-index";
+	else if (!absolute_path(options.index, index_path)) {
+		warn("%s", options.index);
+		return -1;
+	}
+
+	scan();
+	if (index_dirty) save_index();
+	if (options.verbose)
+		printf("library: %zu images\n", images.size());
+
+	ops.getattr = library_getattr;
+	ops.readdir = library_readdir;
+	ops.open    = library_open;
+	ops.read    = library_read;
+	ops.statfs  = library_statfs;
+	ops.init    = library_init;
+	ops.destroy = library_destroy;
+	return 0;
+}
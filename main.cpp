@@ -1,4 +1,4 @@
-// clang++ -std=c++14 -Wall main.cpp `pkg-config fuse --cflags --libs` -o ii-part-fuse
+// clang++ -std=c++14 -Wall *.cpp `pkg-config fuse liblzma zlib --cflags --libs` -o ii-part-fuse
 
 /*
  * Thanks to: 
@@ -17,23 +17,35 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 
 #define FUSE_USE_VERSION 27
 #include <fuse.h>
 
+#include "cache.h"
+#include "chd.h"
+#include "governor.h"
+#include "io.h"
+#include "rangelock.h"
+#include "ii-part.h"
+
 #ifdef __APPLE__
 #include <sys/disk.h>
 #endif
 
 #ifdef __linux__
 #include <sys/mount.h> 
+#include <sys/inotify.h>
 #endif
 
 #ifdef __sun__
@@ -52,14 +64,7 @@
 
 static struct fuse_operations part_operations;;
 
-struct options
-{
-	const char *filename = nullptr;
-	const char *mountpoint = nullptr;
-	// should be int, not bool, to work with OPTION()
-	int verbose = false;
-	int rw = false;
-} options;
+struct options options;
 
 enum {
 	OPTION_HELP = 0,
@@ -89,6 +94,30 @@ static const struct fuse_opt option_spec[] = {
 
 	OPTION("-v",           verbose),
 	OPTION("--verbose",    verbose),
+	OPTION("--check",      check),
+	OPTION("--library",    library),
+	{"--defragment=%s", offsetof(struct options, defragment), 0},
+	{"--build=%s", offsetof(struct options, build), 0},
+	{"--repartition=%s", offsetof(struct options, repartition), 0},
+	{"--catalog=%s", offsetof(struct options, catalog), 0},
+	{"--find=%s", offsetof(struct options, find), 0},
+	{"--export=%s", offsetof(struct options, export_dir), 0},
+	{"--convert=%s", offsetof(struct options, convert), 0},
+	{"--serve=%u", offsetof(struct options, serve), 0},
+	OPTION("shared_cache", shared_cache),
+	OPTION("nufx",         nufx),
+	{ "cache=%u", offsetof(struct options, cache), 0 },
+	{ "memory=%u", offsetof(struct options, memory), 0 },
+	{ "max_fds=%u", offsetof(struct options, max_fds), 0 },
+	{ "index=%s", offsetof(struct options, index), 0 },
+	{ "jobs=%u", offsetof(struct options, jobs), 0 },
+	{ "parent=%s", offsetof(struct options, parent), 0 },
+	{ "containers=%s", offsetof(struct options, containers), 0 },
+	{ "scrub=%s", offsetof(struct options, scrub), 0 },
+	{ "scrub_rate=%u", offsetof(struct options, scrub_rate), 0 },
+	{ "split=%u", offsetof(struct options, split), 0 },
+	{ "depth=%u", offsetof(struct options, depth), 0 },
+	{ "slow=%s", offsetof(struct options, slow), 0 },
 	FUSE_OPT_END
 };
 
@@ -96,8 +125,53 @@ void help(int exitvalue)
 {
 	fputs(
 		"ii-part-fuse [-oro] [-v] filename-or-device [mountpoint]\n"
+		"ii-part-fuse --library [-omax_fds=N] [-oindex=PATH] directory mountpoint\n"
+		"ii-part-fuse --catalog=INDEX [-ojobs=N] image-or-directory...\n"
+		"ii-part-fuse --catalog=INDEX --find=NAME|PATTERN|HASH\n"
+		"ii-part-fuse --check filename-or-device\n"
+		"ii-part-fuse --defragment=NAME filename-or-device\n"
+		"ii-part-fuse --build=focus|zip|microdrive output volume.po...\n"
+		"ii-part-fuse --repartition=NAME:BLOCKS[,...] filename-or-device\n"
+		"ii-part-fuse --export=DIR filename-or-device [NAME...]\n"
+		"ii-part-fuse --convert=OUTPUT filename-or-device-or-volume [NAME]\n"
+		"ii-part-fuse --serve=PORT filename-or-device\n"
+		"    --check                check the ProDOS volumes and exit\n"
+		"    --defragment=NAME      make the files in partition NAME contiguous, sliding\n"
+		"                           others down for room (directories, extended and\n"
+		"                           Pascal files stay put)\n"
+		"    --build=SCHEME         build an image from .po/.hdv/.2mg volumes\n"
+		"    --repartition=NAME:BLOCKS,...\n"
+		"                           resize partitions, moving the others as needed\n"
+		"    --export=DIR           copy partitions to DIR/NAME.po as sparse files\n"
+		"    --convert=OUTPUT       copy a partition or volume to OUTPUT (.2mg, .po,\n"
+		"                           .hdv or .do/.dsk)\n"
+		"    --serve=PORT           serve the partitions over HTTP (with ranges) on\n"
+		"                           127.0.0.1:PORT\n"
 		"    -orw                   read/write\n"
 		"    -oro -ordonly          read only (default)\n"
+		"    -ocache=N              cache N MiB of the device in memory\n"
+		"    -oshared_cache         share the cache with other read-only mounts\n"
+		"                           of the same image\n"
+		"    -omemory=N             keep the caches within N MiB, less under\n"
+		"                           memory pressure\n"
+		"    -oparent=PATH          the parent of a CHD diff image\n"
+		"    -osplit=N              issue reads and writes larger than N KiB as\n"
+		"                           N KiB pieces, side by side\n"
+		"    -odepth=N              with -osplit, at most N pieces at once (default 4)\n"
+		"    -oslow=PROFILE[:KEY=N...]\n"
+		"                           simulate a slow device (cf, zip or none), for\n"
+		"                           benchmarks\n"
+		"    -ocontainers=2mg:hdv:po\n"
+		"                           also show each partition as NAME.2mg etc.\n"
+		"    -onufx                 show the threads in ShrinkIt archives in NAME.nufx\n"
+		"    -oscrub=PATH           re-read the partitions in the background, checking\n"
+		"                           them against the block CRCs in PATH\n"
+		"    -oscrub_rate=N         scrub at most N MiB/s (default 8)\n"
+		"    --library              mount a directory of images, one subdirectory each\n"
+		"    -omax_fds=N            keep at most N images open (default 64)\n"
+		"    -oindex=PATH           partition table index (default DIR/.ii-part-index)\n"
+		"    --catalog=INDEX        index the ProDOS files in images (or search it)\n"
+		"    -ojobs=N               index N images at a time (default 8)\n"
 		"    -v   --verbose         be verbose\n"
 		"    -f                     foreground\n"
 		"    -s                     single-threaded\n"
@@ -130,6 +204,10 @@ static int part_opt_proc(void *data, const char *arg, int key, struct fuse_args
 				options.filename = arg;
 				return 0;
 			}
+			if (options.build || options.catalog || options.export_dir || options.convert) {
+				options.inputs.push_back(arg);
+				return 0;
+			}
 			if (!options.mountpoint) {
 				options.mountpoint = arg;
 				return 1; // save for fuse.
@@ -141,111 +219,19 @@ static int part_opt_proc(void *data, const char *arg, int key, struct fuse_args
 }
 
 
-struct file_info
-{
-	std::string name;
-	off_t start;
-	off_t size;
-
-	bool operator==(const char *s)
-	{
-		return !strcmp(name.c_str(), s);
-	}
-	bool operator==(const std::string &s)
-	{
-		return name == s;
-	}
-};
-
-
 // as there will be 16 or fewer partitions, a vector is fine.
 std::vector<file_info> files;
-int fd;
+int fd = -1;
 off_t total_blocks;
-
-inline uint16_t read16(const unsigned char *data)
-{
-	return data[0] + (data[1] << 8);
-}
-
-inline uint32_t read24(const unsigned char *data)
-{
-	return data[0] + (data[1] << 8) + (data[2] << 16);
-}
-
-inline uint32_t read32(const unsigned char *data)
-{
-	return data[0] + (data[1] << 8) + (data[2] << 16) + (data[3] << 24);
-}
-
-
-
-
-static bool is_microdrive(const unsigned char *data)
-{
-	return data[0] == 0xca && data[1] == 0xcc && read32(data + 0x20) == 256;
-}
-
-static void parse_microdrive(const unsigned char *data)
-{
-	if (options.verbose) {
-		fputs("Found MicroDrive partition\n", stdout);
-	}
-
-	int pcount;
-
-	pcount = data[0x0c];
-	for (int i = 0; i < pcount; ++i) {
-
-		struct file_info f;
-		std::string name;
-
-		name = std::string("MicroDrive1-") + std::to_string(i + 1);
-		unsigned start = read32(data + 0x20 + i * 4);
-		unsigned count = read24(data + 0x40 + i * 4);
-
-		if (options.verbose) {
-			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
-		}
-
-		f.start = start * 512;
-		f.size = count * 512;
-		f.name = std::move(name);
-		files.emplace_back(std::move(f));
-	}
-
-
-	pcount = data[0x0d];
-	for (int i = 0; i < pcount; ++i) {
-
-		struct file_info f;
-		std::string name;
-
-		name = std::string("MicroDrive2-") + std::to_string(i + 1);
-		unsigned start = read32(data + 0x80 + i * 4);
-		unsigned count = read24(data + 0xa0 + i * 4);
-
-		if (options.verbose) {
-			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
-		}
-
-		f.start = start * 512;
-		f.size = count * 512;
-		f.name = std::move(name);
-		files.emplace_back(std::move(f));
-	}
-}
+unsigned io_size = 512;
+std::mutex generation_mutex;
+std::atomic<time_t> backing_mtime;
+// writes this mount has made, so the watchers can tell them from outside ones.
+static std::atomic<uint64_t> self_writes(0);
+const char *scheme = "";
+std::vector<std::pair<std::string, std::string>> root_xattrs;
 
 
-static bool is_focus(const unsigned char *data)
-{
-	return !memcmp(data, "Parsons Engin.", 15);
-}
-
-static bool is_zip(const unsigned char *data)
-{
-	return !memcmp(data, "Zip Technolog.", 15);
-}
 
 off_t file_size(int fd)
 {
@@ -297,79 +283,250 @@ off_t file_size(int fd)
 	return -1;
 }
 
-static void parse_focus(const unsigned char *data)
+// preferred I/O size advertised in st_blksize / f_bsize.
+// tools like cp size their buffers from it, so never advertise less than 128K.
+unsigned io_geometry(int fd)
 {
+	struct stat st;
+	unsigned physical = 512;
+	unsigned optimal = 0;
+
+	if (fstat(fd, &st) < 0) return 512;
+
+	if (S_ISREG(st.st_mode)) optimal = st.st_blksize;
+
+	if (S_ISBLK(st.st_mode)) {
+
+		#if defined(__APPLE__)
+		uint32_t blockSize = 0;
+		if (::ioctl(fd, DKIOCGETPHYSICALBLOCKSIZE, &blockSize) == 0 && blockSize)
+			physical = blockSize;
+		#endif
+
+		#if defined(__linux__)
+
+		#if defined(BLKPBSZGET)
+		unsigned int pbsz = 0;
+		if (::ioctl(fd, BLKPBSZGET, &pbsz) == 0 && pbsz)
+			physical = pbsz;
+		#endif
 
-	if (options.verbose) {
-		fputs("Found focus/zip partition\n", stdout);
+		#if defined(BLKIOOPT)
+		unsigned int opt = 0;
+		if (::ioctl(fd, BLKIOOPT, &opt) == 0)
+			optimal = opt;
+		#endif
+
+		#endif
 	}
 
-	int pcount = data[15];
+	if (options.verbose)
+		printf("physical block size: %u optimal i/o size: %u\n", physical, optimal);
+
+	unsigned size = std::max({ optimal, physical, 128u * 1024 });
+	// keep it a multiple of the physical block size.
+	size = (size + physical - 1) / physical * physical;
+	return size;
+}
 
-	const unsigned char *name_ptr = data + 512 + 0x20;
-	const unsigned char *size_ptr = data + 0x20;
-	for (int i = 0; i < pcount; ++i)
-	{
-		struct file_info f;
 
-		std::string name(name_ptr, name_ptr + 0x20);
-		while (!name.empty() && name.back() == 0x00) name.pop_back();
+// look for a ProDOS volume directory header in block 2.
+static void probe_volume(file_info &f)
+{
+	unsigned char data[512];
 
-		unsigned start = read32(size_ptr + 0);
-		unsigned count = read32(size_ptr + 4);
+	if (f.size < 512 * 3) return;
+	if (device_pread(fd, data, 512, f.start + 512 * 2) != 512) return;
+
+	if (read16(data) != 0) return;
+	if ((data[4] & 0xf0) != 0xf0) return;
+	unsigned len = data[4] & 0x0f;
+	if (!len) return;
+
+	f.volume.assign(data + 5, data + 5 + len);
+}
+
+#ifdef __APPLE__
+#define XATTR_PREFIX "ii-part."
+#else
+#define XATTR_PREFIX "user.ii-part."
+#endif
+
+// everything is computed once, at mount time, so getxattr never touches the device.
+static void make_xattrs()
+{
+	root_xattrs.emplace_back(XATTR_PREFIX "scheme", scheme);
+	root_xattrs.emplace_back(XATTR_PREFIX "blocks", std::to_string(total_blocks));
+	root_xattrs.emplace_back(XATTR_PREFIX "partitions", std::to_string(files.size()));
+
+	int index = 0;
+	for (auto &f : files) {
+		f.xattrs.emplace_back(XATTR_PREFIX "scheme", scheme);
+		f.xattrs.emplace_back(XATTR_PREFIX "index", std::to_string(++index));
+		f.xattrs.emplace_back(XATTR_PREFIX "start", std::to_string(f.start / 512));
+		f.xattrs.emplace_back(XATTR_PREFIX "blocks", std::to_string(f.size / 512));
+		if (!f.volume.empty())
+			f.xattrs.emplace_back(XATTR_PREFIX "volume", f.volume);
+	}
+}
 
-		if (options.verbose) {
-			printf("%d: %-20s %8u %8u\n", i + 1, name.c_str(), start, count);
-		}
 
-		f.name = std::move(name);
-		f.start =  start * 512;
-		f.size = count * 512;
+// called when [start, start + size) of the backing store may have changed.
+static void invalidate_range(off_t start, off_t size)
+{
+	cache_invalidate(start, size);
 
-		files.emplace_back(std::move(f));
+	std::lock_guard<std::mutex> lock(generation_mutex);
 
-		name_ptr += 0x20;
-		size_ptr += 0x10;
+	for (auto &f : files) {
+		if (f.start + f.size <= start || start + size <= f.start) continue;
+		++f.generation;
 	}
 }
 
-#if 0
-static bool is_vulcan(const unsigned char *data)
+uint64_t mtime_ns(const struct stat &st)
 {
-	return data[0] == 0xae && data[1] == 0xae;
+	#if defined(__APPLE__)
+	return st.st_mtimespec.tv_sec * UINT64_C(1000000000) + st.st_mtimespec.tv_nsec;
+	#else
+	return st.st_mtim.tv_sec * UINT64_C(1000000000) + st.st_mtim.tv_nsec;
+	#endif
 }
-// untested / unconfirmed
-static void parse_vulcan(const unsigned char *data)
+
+// block devices (and everything on macOS) are polled: the mtime/size of the
+// node and the partition map itself are compared once a second. an mtime
+// change in a second this mount wrote in is taken to be its own (which the
+// write invalidated already); an outside write in the same second is missed.
+static void poll_backing()
 {
-	unsigned start = 1;
-	data += 0x100;
-	for (unsigned i = 0; i < 15; ++i, data += 16) {
-		int flags = data[6];
-		unsigned count = read16(data + 3);
-		if (flags & 0x20) {
-			char tmp[10];
-			std::transform(data + 7, data + 16, tmp, [](uint8t_t c){ return c & 0x7f });
+	struct stat st;
+	unsigned char header[512 * 3];
+	unsigned char buffer[512 * 3];
 
-			std::string name(tmp, tmp+10);
-			while (!name.empty() && name.back() == 0x00) name.pop_back();
+	if (fstat(fd, &st) < 0) return;
+	uint64_t mtime = mtime_ns(st);
+	off_t size = st.st_size;
+	bool have_header = pread(fd, header, sizeof(header), 0) == sizeof(header);
+	uint64_t writes = self_writes;
+
+	for (;;) {
+		sleep(1);
+
+		bool changed = false;
+		uint64_t now_writes = self_writes;
+		if (fstat(fd, &st) == 0 && (mtime_ns(st) != mtime || st.st_size != size)) {
+			mtime = mtime_ns(st);
+			backing_mtime = st.st_mtime;
+			changed = st.st_size != size || now_writes == writes;
+			size = st.st_size;
+		}
+		writes = now_writes;
 
-			struct file_info f;
-			f.name = std::move(name);
-			f.start = start * 512;
-			f.size = count * 512;
+		if (have_header && pread(fd, buffer, sizeof(buffer), 0) == sizeof(buffer)) {
+			if (memcmp(header, buffer, sizeof(header))) {
+				warnx("%s: partition map changed; remount to pick up the new layout", options.filename);
+				memcpy(header, buffer, sizeof(header));
+				changed = true;
+			}
 		}
-		start += count;
+
+		if (changed) invalidate_range(0, total_blocks * 512);
 	}
 }
+
+#ifdef __linux__
+// inotify doesn't say what changed, so any write invalidates everything.
+// IN_MODIFY would fire for this mount's own writes too (and empty the cache
+// on every one); another writer shows up when it closes the file, or
+// truncates or touches it.
+static void watch_backing()
+{
+	struct stat st;
+	std::string path = "/proc/self/fd/" + std::to_string(fd);
+
+	int ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd < 0 || inotify_add_watch(ifd, path.c_str(), IN_ATTRIB | IN_CLOSE_WRITE) < 0) {
+		if (ifd >= 0) close(ifd);
+		if (options.verbose) warn("inotify");
+		poll_backing();
+		return;
+	}
+
+	alignas(struct inotify_event) char buffer[4096];
+	for (;;) {
+		ssize_t ok = read(ifd, buffer, sizeof(buffer));
+		if (ok < 0 && errno == EINTR) continue;
+		if (ok <= 0) break;
+
+		if (fstat(fd, &st) == 0) backing_mtime = st.st_mtime;
+		invalidate_range(0, total_blocks * 512);
+	}
+	close(ifd);
+}
 #endif
 
+static void *part_init(struct fuse_conn_info *conn)
+{
+	// fuse_main has daemonized by now, so threads started here survive.
+	struct stat st;
+	if (fstat(fd, &st) < 0) return nullptr;
+
+	backing_mtime = st.st_mtime;
+	chd_start();
+	io_start(std::max(options.depth, 4u));
+	governor_start();
+	scrub_start();
+
+	#ifdef __linux__
+	if (S_ISREG(st.st_mode)) {
+		std::thread(watch_backing).detach();
+		return nullptr;
+	}
+	#endif
+
+	std::thread(poll_backing).detach();
+	return nullptr;
+}
+
+
+// the whole card, for tools that want it raw. reads go through the same
+// cache and counters as the partitions.
+static const std::string device_name = ".device";
+
+// the range of the device path covers: a partition, or all of it.
+static bool find_range(const char *path, off_t &start, off_t &size)
+{
+	const std::string spath(path + 1);
+
+	if (spath == device_name) {
+		start = 0;
+		size = total_blocks * 512;
+		return true;
+	}
+	auto iter = std::find(files.begin(), files.end(), spath);
+	if (iter == files.end()) return false;
+	start = iter->start;
+	size = iter->size;
+	return true;
+}
 
 static int part_open(const char *path, struct fuse_file_info *fi)
 {
 	const std::string spath(path + 1);
+	if (spath == device_name) {
+		fi->keep_cache = 0;
+		return 0;
+	}
+
 	auto iter = std::find(files.begin(), files.end(), spath);
 	if (iter == files.end()) return -ENOENT;
 
+	// keep the kernel page cache unless the backing store changed since the last open.
+	file_info &f = *iter;
+	std::lock_guard<std::mutex> lock(generation_mutex);
+	fi->keep_cache = f.cached_generation == f.generation;
+	f.cached_generation = f.generation;
+
 	return 0;
 }
 
@@ -377,7 +534,7 @@ static int part_statfs(const char *path, struct statvfs *stbuf)
 {
 	memset(stbuf, 0, sizeof(*stbuf));
 
-	stbuf->f_bsize = 512;
+	stbuf->f_bsize = io_size;
 	stbuf->f_frsize = 512;
 	stbuf->f_bfree = 0;
 	stbuf->f_bavail = 0;
@@ -397,16 +554,20 @@ static int part_getattr(const char *path, struct stat *stbuf)
 	if (spath.empty()) {
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2 + files.size();
+		stbuf->st_blksize = io_size;
 		return 0;
 	}
-	auto iter = std::find(files.begin(), files.end(), spath);
-	if (iter == files.end()) return -ENOENT;
-
-	const file_info &f = *iter;
+	off_t start, size;
+	if (!find_range(path, start, size)) return -ENOENT;
 
-	stbuf->st_mode = S_IFREG | 0666;
+	// .device is read-only: the partitions are the way to change things.
+	stbuf->st_mode = spath == device_name ? S_IFREG | 0444 : S_IFREG | 0666;
 	stbuf->st_nlink = 1;
-	stbuf->st_size = f.size;
+	stbuf->st_size = size;
+	stbuf->st_mtime = backing_mtime;
+	stbuf->st_ctime = backing_mtime;
+	stbuf->st_blksize = io_size;
+	stbuf->st_blocks = size / 512;
 	return 0;
 }
 
@@ -419,46 +580,241 @@ static int part_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off
 
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    filler(buf, device_name.c_str(), NULL, 0);
     for(const auto &f : files)
 	    filler(buf, f.name.c_str(), NULL, 0);
 
     return 0;
 }
 
+// the backends the I/O operations are instantiated for. setup() picks one,
+// so a request doesn't test for features that are off.
+struct plain_device
+{
+	static ssize_t pread(int fd, void *buf, size_t size, off_t offset) { return ::pread(fd, buf, size, offset); }
+	static ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset) { return device_pwrite(fd, buf, size, offset); }
+	static void invalidate(off_t, off_t) {}
+	// read_buf can hand fuse the descriptor.
+	static constexpr bool splice = true;
+};
+
+// also -oslow, which mustn't be bypassed by splicing.
+struct chd_device
+{
+	static ssize_t pread(int fd, void *buf, size_t size, off_t offset) { return device_pread(fd, buf, size, offset); }
+	static ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset) { return device_pwrite(fd, buf, size, offset); }
+	static void invalidate(off_t, off_t) {}
+	static constexpr bool splice = false;
+};
+
+// cache_pread reads a CHD, if that's what's underneath.
+struct cached_device
+{
+	static ssize_t pread(int fd, void *buf, size_t size, off_t offset) { return cache_pread(fd, buf, size, offset); }
+	static ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset) { return device_pwrite(fd, buf, size, offset); }
+	static void invalidate(off_t offset, off_t size) { cache_invalidate(offset, size); }
+	static constexpr bool splice = false;
+};
+
+// -osplit: a request larger than a chunk is cut into aligned chunks, at most
+// -odepth of them in flight at a time, each read (or written) by the io pool
+// straight into (or out of) the caller's buffer. the result is the bytes up
+// to the first chunk that came up short.
+template <class Buffer, class Op>
+static ssize_t split_io(Op op, int fd, Buffer *buf, size_t size, off_t offset)
+{
+	const size_t chunk = (size_t)options.split << 10;
+	if (size <= chunk) return op(fd, buf, size, offset);
+
+	struct piece { size_t pos; size_t size; ssize_t result; };
+	std::vector<piece> pieces;
+	for (size_t pos = 0; pos < size; ) {
+		size_t n = std::min<size_t>(chunk - (offset + pos) % chunk, size - pos);
+		pieces.push_back({ pos, n, 0 });
+		pos += n;
+	}
+
+	io_batch batch;
+	for (size_t i = 0; i < pieces.size(); ++i) {
+		piece &p = pieces[i];
+		batch.add([=, &p]{
+			p.result = op(fd, buf + p.pos, p.size, offset + p.pos);
+			return p.result >= 0;
+		});
+		if ((i + 1) % options.depth == 0 && !batch.wait()) return -1;
+	}
+	if (!batch.wait()) return -1;
+
+	ssize_t total = 0;
+	for (const auto &p : pieces) {
+		total += p.result;
+		if ((size_t)p.result < p.size) break;
+	}
+	return total;
+}
+
+template <class Base>
+struct split_device : Base
+{
+	static ssize_t pread(int fd, void *buf, size_t size, off_t offset)
+	{
+		return split_io([](int fd, char *buf, size_t size, off_t offset) {
+			return Base::pread(fd, buf, size, offset);
+		}, fd, (char *)buf, size, offset);
+	}
+	static ssize_t pwrite(int fd, const void *buf, size_t size, off_t offset)
+	{
+		return split_io([](int fd, const char *buf, size_t size, off_t offset) {
+			return Base::pwrite(fd, buf, size, offset);
+		}, fd, (const char *)buf, size, offset);
+	}
+};
+
+template <class Device, class Lock>
 static int part_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-	const std::string spath(path + 1);
+	off_t start, end;
 	ssize_t ok;
 
-	auto iter = std::find(files.begin(), files.end(), spath);
-	if (iter == files.end()) return -ENOENT;
-
-	const file_info &f = *iter;
-	if (offset >= f.size) return 0;
-	if (offset + size > f.size) size = f.size - offset;
+	if (!find_range(path, start, end)) return -ENOENT;
+	if (offset >= end) return 0;
+	if (offset + size > end) size = end - offset;
 
-	ok = pread(fd, buf, size, f.start + offset);
+	Lock lock(start + offset, size, false);
+	ok = Device::pread(fd, buf, size, start + offset);
 	if (ok < 0) return -errno;
+	stats_account(start + offset, ok, false);
 	return ok;
 }
 
+static void free_bufvec(struct fuse_bufvec *bv)
+{
+	int error = errno;
+	for (size_t i = 0; i < bv->count; ++i) {
+		if (!(bv->buf[i].flags & FUSE_BUF_IS_FD)) free(bv->buf[i].mem);
+	}
+	free(bv);
+	errno = error;
+}
+
+// prefix_size bytes of prefix, then [offset, offset + size) of the device.
+// without a cache or a CHD in the way, the device part is handed to fuse as
+// a file descriptor, which it splices (or preads) straight into the reply;
+// not when writes are locked out, though, as fuse reads it after we return.
+template <class Device, class Lock>
+static struct fuse_bufvec *make_bufvec(const void *prefix, size_t prefix_size, off_t offset, size_t size)
+{
+	struct fuse_bufvec *bv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf));
+	if (!bv) return nullptr;
+
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = 0;
+
+	if (prefix_size) {
+		struct fuse_buf &b = bv->buf[bv->count++];
+		b.size = prefix_size;
+		b.mem = malloc(prefix_size);
+		if (!b.mem) {
+			free_bufvec(bv);
+			return nullptr;
+		}
+		memcpy(b.mem, prefix, prefix_size);
+	}
+
+	if (size) {
+		struct fuse_buf &b = bv->buf[bv->count++];
+		b.size = size;
+		b.flags = (enum fuse_buf_flags)0;
+		b.mem = nullptr;
+		b.fd = -1;
+		b.pos = 0;
+		if (Device::splice && !Lock::enabled) {
+			b.flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+			b.fd = fd;
+			b.pos = offset;
+			stats_account(offset, size, false);
+			return bv;
+		}
+		b.mem = malloc(size);
+		Lock lock(offset, size, false);
+		ssize_t ok = b.mem ? Device::pread(fd, b.mem, size, offset) : -1;
+		if (ok < 0) {
+			free_bufvec(bv);
+			return nullptr;
+		}
+		b.size = ok;
+		stats_account(offset, ok, false);
+	}
+	return bv;
+}
+
+static struct fuse_bufvec *(*bufvec)(const void *, size_t, off_t, size_t) = make_bufvec<cached_device, no_range_lock>;
+
+struct fuse_bufvec *device_bufvec(const void *prefix, size_t prefix_size, off_t offset, size_t size)
+{
+	return bufvec(prefix, prefix_size, offset, size);
+}
+
+template <class Device, class Lock>
+static int part_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	off_t start, end;
+
+	if (!find_range(path, start, end)) return -ENOENT;
+	if (offset >= end) size = 0;
+	else if (offset + size > end) size = end - offset;
+
+	*bufp = make_bufvec<Device, Lock>(nullptr, 0, start + offset, size);
+	if (!*bufp) return -errno;
+	return 0;
+}
+
+template <class Device, class Lock>
 static int part_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	const std::string spath(path + 1);
+	off_t start, end;
 	ssize_t ok;
 
-	auto iter = std::find(files.begin(), files.end(), spath);
-	if (iter == files.end()) return -ENOENT;
+	if (spath == device_name) return -EACCES;
+	if (!find_range(path, start, end)) return -ENOENT;
+	if (offset >= end) return -ENOSPC;
+	if (offset + size > end) size = end - offset;
 
-	const file_info &f = *iter;
-	if (offset >= f.size) return -ENOSPC;
-	if (offset + size > f.size) size = f.size - offset;
-
-	ok = pwrite(fd, buf, size, f.start + offset);
+	Lock lock(start + offset, size, true);
+	ok = Device::pwrite(fd, buf, size, start + offset);
 	if (ok < 0) return -errno;
+	Device::invalidate(start + offset, ok);
+	++self_writes;
+	stats_account(start + offset, ok, true);
+	scrub_written(start + offset, ok);
 	return ok;
 }
 
+template <class Device, class Lock>
+static void use_operations()
+{
+	part_operations.read     = part_read<Device, Lock>;
+	part_operations.read_buf = part_read_buf<Device, Lock>;
+	part_operations.write    = part_write<Device, Lock>;
+	bufvec = make_bufvec<Device, Lock>;
+}
+
+// read-only mounts have no writes to lock out.
+template <class Device>
+static void use_locking()
+{
+	if (options.rw) use_operations<Device, range_lock>();
+	else use_operations<Device, no_range_lock>();
+}
+
+template <class Device>
+static void use_device()
+{
+	if (options.split) use_locking<split_device<Device>>();
+	else use_locking<Device>();
+}
+
 static int part_fsync(const char *, int, struct fuse_file_info *)
 {
 	int ok = fsync(fd);
@@ -466,6 +822,137 @@ static int part_fsync(const char *, int, struct fuse_file_info *)
 	return 0;
 }
 
+// counters change constantly, so they're generated on request.
+static void stats_xattrs(std::vector<std::pair<std::string, std::string>> &xattrs)
+{
+	if (cache_enabled()) {
+		cache_stats st;
+		cache_get_stats(st);
+		xattrs.emplace_back(XATTR_PREFIX "cache.size", std::to_string(st.bytes));
+		xattrs.emplace_back(XATTR_PREFIX "cache.shared", st.shared ? "1" : "0");
+		xattrs.emplace_back(XATTR_PREFIX "cache.shards", std::to_string(st.shards));
+		xattrs.emplace_back(XATTR_PREFIX "cache.hits", std::to_string(st.hits));
+		xattrs.emplace_back(XATTR_PREFIX "cache.misses", std::to_string(st.misses));
+	}
+	scrub_stats scrub;
+	scrub_get_stats(scrub);
+	if (scrub.enabled) {
+		xattrs.emplace_back(XATTR_PREFIX "scrub.passes", std::to_string(scrub.passes));
+		xattrs.emplace_back(XATTR_PREFIX "scrub.blocks", std::to_string(scrub.blocks));
+		xattrs.emplace_back(XATTR_PREFIX "scrub.mismatches", std::to_string(scrub.mismatches));
+		if (scrub.last_mismatch >= 0)
+			xattrs.emplace_back(XATTR_PREFIX "scrub.last_mismatch", std::to_string(scrub.last_mismatch));
+	}
+	slow_stats slow;
+	slow_get_stats(slow);
+	if (slow.enabled) {
+		xattrs.emplace_back(XATTR_PREFIX "slow.requests", std::to_string(slow.requests));
+		xattrs.emplace_back(XATTR_PREFIX "slow.errors", std::to_string(slow.errors));
+		xattrs.emplace_back(XATTR_PREFIX "slow.busy_ms", std::to_string(slow.busy_ns / 1000000));
+	}
+	if (governor_enabled()) {
+		memory_stats st;
+		governor_get_stats(st);
+		xattrs.emplace_back(XATTR_PREFIX "memory.budget", std::to_string(st.budget));
+		xattrs.emplace_back(XATTR_PREFIX "memory.used", std::to_string(st.used));
+		xattrs.emplace_back(XATTR_PREFIX "memory.configured", std::to_string(st.configured));
+		if (st.pressure >= 0) {
+			char buffer[16];
+			snprintf(buffer, sizeof(buffer), "%d.%02d", st.pressure / 100, st.pressure % 100);
+			xattrs.emplace_back(XATTR_PREFIX "memory.pressure", buffer);
+		}
+	}
+}
+
+static void io_xattrs(std::vector<std::pair<std::string, std::string>> &xattrs, const char *prefix, const io_stats &st)
+{
+	std::string name = XATTR_PREFIX "stats.";
+	name += prefix;
+	xattrs.emplace_back(name + "reads", std::to_string(st.reads));
+	xattrs.emplace_back(name + "read_bytes", std::to_string(st.read_bytes));
+	xattrs.emplace_back(name + "writes", std::to_string(st.writes));
+	xattrs.emplace_back(name + "write_bytes", std::to_string(st.write_bytes));
+}
+
+static const std::vector<std::pair<std::string, std::string>> *find_xattrs(const char *path, std::vector<std::pair<std::string, std::string>> &tmp)
+{
+	const std::string spath(path + 1);
+
+	if (spath.empty()) {
+		tmp = root_xattrs;
+		stats_xattrs(tmp);
+		return &tmp;
+	}
+
+	io_stats st;
+	if (spath == device_name) {
+		// everything, and the part outside the partitions.
+		io_stats total;
+		for (size_t i = 0; stats_get(i, st); ++i) {
+			total.reads += st.reads;
+			total.read_bytes += st.read_bytes;
+			total.writes += st.writes;
+			total.write_bytes += st.write_bytes;
+		}
+		tmp.clear();
+		io_xattrs(tmp, "", total);
+		if (stats_get(files.size(), st)) io_xattrs(tmp, "outside.", st);
+		return &tmp;
+	}
+
+	auto iter = std::find(files.begin(), files.end(), spath);
+	if (iter == files.end()) return nullptr;
+	tmp = iter->xattrs;
+	if (stats_get(iter - files.begin(), st)) io_xattrs(tmp, "", st);
+	return &tmp;
+}
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+#ifdef __APPLE__
+static int part_getxattr(const char *path, const char *name, char *value, size_t size, uint32_t position)
+#else
+static int part_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
+{
+	std::vector<std::pair<std::string, std::string>> tmp;
+	auto xattrs = find_xattrs(path, tmp);
+	if (!xattrs) return -ENOENT;
+
+	for (const auto &x : *xattrs) {
+		if (x.first != name) continue;
+
+		const std::string &s = x.second;
+		if (size == 0) return s.size();
+		if (size < s.size()) return -ERANGE;
+		memcpy(value, s.data(), s.size());
+		return s.size();
+	}
+	return -ENOATTR;
+}
+
+static int part_listxattr(const char *path, char *list, size_t size)
+{
+	std::vector<std::pair<std::string, std::string>> tmp;
+	auto xattrs = find_xattrs(path, tmp);
+	if (!xattrs) return -ENOENT;
+
+	size_t length = 0;
+	for (const auto &x : *xattrs)
+		length += x.first.size() + 1;
+
+	if (size == 0) return length;
+	if (size < length) return -ERANGE;
+
+	for (const auto &x : *xattrs) {
+		memcpy(list, x.first.c_str(), x.first.size() + 1);
+		list += x.first.size() + 1;
+	}
+	return length;
+}
+
 
 #ifdef __APPLE__
 
@@ -494,47 +981,116 @@ std::string make_mount_dir()
 
 
 
+// shared cache segments are keyed by the identity of the image, so every
+// mount of the same (unmodified) image finds the same segment.
+static std::string shared_cache_name(int fd)
+{
+	struct stat st;
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+	if (fstat(fd, &st) < 0) return "";
+
+	uint64_t values[] = {
+		(uint64_t)st.st_dev,
+		(uint64_t)st.st_ino,
+		(uint64_t)st.st_rdev,
+		(uint64_t)st.st_size,
+		S_ISREG(st.st_mode) ? mtime_ns(st) : 0,
+	};
+	for (uint64_t v : values) {
+		for (int i = 0; i < 8; ++i) {
+			hash ^= (v >> (i * 8)) & 0xff;
+			hash *= UINT64_C(0x100000001b3);
+		}
+	}
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "/ii-part-%016llx", (unsigned long long)hash);
+	return buffer;
+}
+
 static int setup(const char *path)
 {
-	unsigned char buffer[512 * 3];
+	unsigned char buffer[512 * FOCUS_HEADER_BLOCKS];
 
 	if (options.verbose) warnx("Opening %s for %s", path, options.rw ? "read-write" : "read-only");
 	fd = open(path, options.rw ? O_RDWR : O_RDONLY);
 	if (fd < 0) err(1, "Unable to open %s", path);
 
 
-	if (read(fd, buffer, sizeof(buffer)) < sizeof(buffer)) err(1, "Unable to read %s", path);
-
-	off_t size = file_size(fd);
+	off_t size;
+	if (chd_open(fd, path, options.parent, size)) {
+		if (options.rw) errx(1, "%s: CHD images are read-only", path);
+	} else {
+		size = file_size(fd);
+	}
 	if (size == (off_t)-1)
 		errx(1, "Unable to determine file size\n");
 
+	if (device_pread(fd, buffer, sizeof(buffer), 0) < (ssize_t)sizeof(buffer)) err(1, "Unable to read %s", path);
+
 	if (size & 511)
 		errx(1, "Bad file size");
 
 	total_blocks = size / 512;
+	io_size = io_geometry(fd);
+	if (options.slow) slow_setup(options.slow, size);
 
 	if (is_focus(buffer) || is_zip(buffer)) {
-		parse_focus(buffer);
-		return 0;
+		scheme = is_zip(buffer) ? "zip" : "focus";
+		parse_focus(buffer, files);
+	} else if (is_microdrive(buffer)) {
+		scheme = "microdrive";
+		parse_microdrive(buffer, files);
+	} else {
+		close(fd);
+		errx(1, "Unknown partition type.");
 	}
 
-	if (is_microdrive(buffer)) {
-		parse_microdrive(buffer);
-		return 0;
-	}
+	for (auto &f : files)
+		probe_volume(f);
+
+	make_xattrs();
+	stats_setup();
+	if (options.scrub && !scrub_setup(options.scrub)) exit(1);
 
-	close(fd);
-	errx(1, "Unknown partition type.");
+	if (options.shared_cache && options.rw)
+		errx(1, "-oshared_cache requires a read-only mount");
 
+	if (options.shared_cache && !options.cache)
+		options.cache = 64;
+
+	if (options.cache) {
+		std::string name;
+		if (options.shared_cache) name = shared_cache_name(fd);
 
-	part_operations.statfs  = part_statfs;
-	part_operations.getattr = part_getattr;
-	part_operations.open    = part_open;
-	part_operations.read    = part_read;
-	part_operations.write   = part_write;
-	part_operations.readdir = part_readdir;
-	part_operations.fsync   = part_fsync;
+		if (!cache_init(size, (size_t)options.cache << 20, name.empty() ? nullptr : name.c_str())) {
+			if (name.empty()) errx(1, "Unable to create cache");
+			warnx("Falling back to a private cache");
+			if (!cache_init(size, (size_t)options.cache << 20, nullptr))
+				errx(1, "Unable to create cache");
+		}
+		if (options.verbose)
+			printf("cache: %u MiB%s%s\n", options.cache, name.empty() ? "" : " shared as ", name.c_str());
+	}
+
+	part_operations.init      = part_init;
+	part_operations.statfs    = part_statfs;
+	part_operations.getattr   = part_getattr;
+	part_operations.open      = part_open;
+	part_operations.readdir   = part_readdir;
+	part_operations.fsync     = part_fsync;
+	part_operations.getxattr  = part_getxattr;
+	part_operations.listxattr = part_listxattr;
+
+	if (!options.depth) options.depth = 1;
+	if (cache_enabled()) use_device<cached_device>();
+	else if (chd_enabled() || slow_enabled()) use_device<chd_device>();
+	else use_device<plain_device>();
+
+	if (options.nufx) nufx_setup(part_operations);
+	if (options.containers) container_setup(part_operations);
+	return 0;
 }
 
 
@@ -549,9 +1105,59 @@ int main(int argc, char **argv)
 		help(EX_USAGE);
 
 
+	if (options.catalog && options.find)
+		return catalog_find(options.catalog, options.find);
+
 	if (!options.filename) help(EX_USAGE);
 
-	if (setup(options.filename) < 0) return 1;
+	if (options.catalog) {
+		options.inputs.insert(options.inputs.begin(), options.filename);
+		return catalog_build(options.catalog, options.inputs);
+	}
+
+	if (options.build)
+		return build_image(options.build, options.filename, options.inputs);
+
+	if (options.convert)
+		return convert_image(options.convert, options.filename, options.inputs);
+
+	if (options.defragment || options.repartition) options.rw = true;
+
+	if (options.library) {
+		if (library_setup(options.filename, part_operations) < 0) return 1;
+	} else {
+		if (setup(options.filename) < 0) return 1;
+	}
+
+	if (options.check) {
+		ok = check_volumes();
+		close(fd);
+		return ok;
+	}
+
+	if (options.defragment) {
+		ok = defragment_volume(options.defragment);
+		close(fd);
+		return ok;
+	}
+
+	if (options.repartition) {
+		ok = repartition(options.repartition);
+		close(fd);
+		return ok;
+	}
+
+	if (options.export_dir) {
+		ok = export_partitions(options.export_dir, options.inputs);
+		close(fd);
+		return ok;
+	}
+
+	if (options.serve) {
+		ok = serve_partitions(options.serve);
+		close(fd);
+		return ok;
+	}
 
 	#ifdef __APPLE__
 	if (!options.mountpoint) {
@@ -566,6 +1172,12 @@ int main(int argc, char **argv)
 	if (!options.mountpoint) help(1);
 	#endif
 
+	#ifdef __linux__
+	// without big_writes, fuse 2 splits writes into 4K requests.
+	if (options.rw)
+		fuse_opt_add_arg(&args, "-obig_writes");
+	#endif
+
 	if (options.verbose)
 		printf ("Mounting %s to %s\n", options.filename, options.mountpoint);
 
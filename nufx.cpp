@@ -0,0 +1,655 @@
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define FUSE_USE_VERSION 27
+#include <fuse.h>
+
+#include "governor.h"
+#include "ii-part.h"
+#include "prodos.h"
+
+/*
+ * -onufx: ShrinkIt (NuFX) archives in a ProDOS partition, as files.
+ *
+ * /NAME.nufx/ has a directory for each archive (type $E0/$8002) in
+ * partition NAME, named by its path with ':' for '/'. Each of those has a
+ * file for each thread: the data fork by the record name, the resource fork
+ * with .rsrc and a disk image with .po appended.
+ *
+ * Threads stored uncompressed, LZW/1 or LZW/2 are supported. Decompressed
+ * threads are cached (by a hash of the compressed bytes, so an unchanged
+ * archive is never expanded twice) in an LRU bounded at 64 MiB. Opening a
+ * thread expands every uncached thread of the archive in parallel.
+ */
+
+namespace {
+
+enum {
+	THREAD_MESSAGE = 0,
+	THREAD_CONTROL = 1,
+	THREAD_DATA = 2,
+	THREAD_FILENAME = 3,
+};
+
+enum {
+	FORMAT_UNCOMPRESSED = 0,
+	FORMAT_LZW1 = 2,
+	FORMAT_LZW2 = 3,
+};
+
+const size_t cache_limit = 64 << 20;
+const unsigned chunk_size = 4096;
+
+struct thread_info
+{
+	std::string name;
+	unsigned format;
+	uint32_t offset; // in the archive
+	uint32_t comp_size;
+	uint32_t size;
+};
+
+struct archive
+{
+	std::string name;
+	unsigned storage_type;
+	unsigned key;
+	uint32_t eof;
+
+	bool parsed = false;
+	std::vector<thread_info> threads;
+};
+
+struct view
+{
+	std::mutex mutex;
+	bool scanned = false;
+	unsigned generation = 0;
+	std::vector<archive> archives;
+};
+
+typedef std::shared_ptr<const std::vector<unsigned char>> buffer_ptr;
+
+std::vector<std::unique_ptr<view>> views; // parallel to files
+struct fuse_operations base; // the partition operations
+
+std::mutex cache_mutex;
+std::list<std::pair<uint64_t, buffer_ptr>> lru;
+std::unordered_map<uint64_t, decltype(lru)::iterator> lru_map;
+size_t cache_bytes = 0;
+
+void shrink_cache();
+governed memory("nufx", cache_limit, shrink_cache);
+
+
+// caller holds cache_mutex.
+void evict()
+{
+	size_t limit = memory.limit.load(std::memory_order_relaxed);
+	while (cache_bytes > limit && lru.size() > 1) {
+		cache_bytes -= lru.back().second->size();
+		lru_map.erase(lru.back().first);
+		lru.pop_back();
+	}
+	memory.used.store(cache_bytes, std::memory_order_relaxed);
+}
+
+void shrink_cache()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	evict();
+}
+
+buffer_ptr cache_find(uint64_t key)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	auto iter = lru_map.find(key);
+	if (iter == lru_map.end()) return nullptr;
+	lru.splice(lru.begin(), lru, iter->second);
+	return iter->second->second;
+}
+
+void cache_add(uint64_t key, buffer_ptr data)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	if (lru_map.count(key)) return;
+	lru.emplace_front(key, data);
+	lru_map[key] = lru.begin();
+	cache_bytes += data->size();
+	evict();
+}
+
+
+/*
+ * ShrinkIt LZW. Codes are 9 to 12 bits, packed LSB first; 0x100 clears the
+ * table and the first code after a clear is a literal. The width is the
+ * number of bits needed for the next free entry + 1.
+ */
+struct lzw
+{
+	enum { CLEAR = 0x100, FIRST = 0x101, LIMIT = 0x1000 };
+
+	uint16_t prefix[LIMIT];
+	uint8_t suffix[LIMIT];
+	uint8_t stack[LIMIT];
+	unsigned entry = FIRST;
+	bool reset = true; // next code is a literal
+	unsigned prev = 0;
+	uint8_t first_char = 0;
+
+	void clear()
+	{
+		entry = FIRST;
+		reset = true;
+	}
+
+	unsigned width() const
+	{
+		unsigned n = entry + 1;
+		if (n < 0x200) return 9;
+		if (n < 0x400) return 10;
+		if (n < 0x800) return 11;
+		return 12;
+	}
+
+	// expand one chunk (byte aligned, size bytes out). *used is the input consumed.
+	bool expand(const unsigned char *in, size_t in_size, unsigned char *out, unsigned size, size_t *used)
+	{
+		uint32_t bits = 0;
+		unsigned count = 0;
+		size_t pos = 0;
+		unsigned done = 0;
+
+		while (done < size) {
+			unsigned w = width();
+			while (count < w) {
+				if (pos >= in_size) return false;
+				bits |= in[pos++] << count;
+				count += 8;
+			}
+			unsigned code = bits & ((1 << w) - 1);
+			bits >>= w;
+			count -= w;
+
+			if (code == CLEAR) {
+				clear();
+				continue;
+			}
+
+			if (reset) {
+				if (code > 0xff) return false;
+				out[done++] = code;
+				prev = code;
+				first_char = code;
+				reset = false;
+				continue;
+			}
+
+			unsigned sp = 0;
+			unsigned c = code;
+			if (code > entry) return false;
+			if (code == entry) {
+				stack[sp++] = first_char;
+				c = prev;
+			}
+			while (c > 0xff) {
+				if (sp >= LIMIT) return false;
+				stack[sp++] = suffix[c];
+				c = prefix[c];
+			}
+			stack[sp++] = c;
+			first_char = c;
+
+			if (done + sp > size) return false;
+			while (sp) out[done++] = stack[--sp];
+
+			if (entry < LIMIT) {
+				prefix[entry] = prev;
+				suffix[entry] = first_char;
+				++entry;
+			}
+			prev = code;
+		}
+		*used = pos;
+		return true;
+	}
+};
+
+// delimiter, character, count: count + 1 copies.
+bool unrle(const unsigned char *in, size_t in_size, unsigned char delimiter, unsigned char *out)
+{
+	unsigned done = 0;
+	for (size_t i = 0; i < in_size; ) {
+		if (in[i] == delimiter) {
+			if (i + 2 >= in_size) return false;
+			unsigned n = in[i + 2] + 1;
+			if (done + n > chunk_size) return false;
+			memset(out + done, in[i + 1], n);
+			done += n;
+			i += 3;
+		} else {
+			if (done >= chunk_size) return false;
+			out[done++] = in[i++];
+		}
+	}
+	return done == chunk_size;
+}
+
+bool expand(unsigned format, const unsigned char *in, size_t in_size, uint32_t size, std::vector<unsigned char> &out)
+{
+	out.clear();
+	if (format == FORMAT_UNCOMPRESSED) {
+		if (in_size < size) return false;
+		out.assign(in, in + size);
+		return true;
+	}
+
+	size_t pos = format == FORMAT_LZW1 ? 4 : 2; // [crc,] volume, delimiter
+	if (in_size < pos) return false;
+	unsigned char delimiter = in[pos - 1];
+
+	std::unique_ptr<lzw> state(new lzw);
+	unsigned char rle[chunk_size];
+	unsigned char chunk[chunk_size];
+
+	out.reserve((size + chunk_size - 1) / chunk_size * chunk_size);
+	while (out.size() < size) {
+		unsigned rle_size;
+		bool compressed;
+		size_t end = 0;
+
+		if (format == FORMAT_LZW1) {
+			if (pos + 3 > in_size) return false;
+			rle_size = read16(in + pos);
+			compressed = in[pos + 2];
+			pos += 3;
+		} else {
+			if (pos + 2 > in_size) return false;
+			rle_size = read16(in + pos) & 0x1fff;
+			compressed = in[pos + 1] & 0x80;
+			if (compressed) {
+				if (pos + 4 > in_size) return false;
+				end = pos + read16(in + pos + 2);
+				pos += 4;
+			} else pos += 2;
+		}
+		if (rle_size > chunk_size) return false;
+
+		if (compressed) {
+			// LZW/1 starts every chunk with an empty table; LZW/2 only after a clear.
+			if (format == FORMAT_LZW1) state->clear();
+			size_t used;
+			if (!state->expand(in + pos, in_size - pos, rle, rle_size, &used)) return false;
+			pos += used;
+			if (format == FORMAT_LZW2 && end >= pos && end <= in_size) pos = end;
+		} else {
+			if (pos + rle_size > in_size) return false;
+			memcpy(rle, in + pos, rle_size);
+			pos += rle_size;
+			if (format == FORMAT_LZW2) state->clear();
+		}
+
+		if (rle_size == chunk_size) memcpy(chunk, rle, chunk_size);
+		else if (!unrle(rle, rle_size, delimiter, chunk)) return false;
+		out.insert(out.end(), chunk, chunk + chunk_size);
+	}
+	out.resize(size);
+	return true;
+}
+
+
+// "NuFile" and "NuFX" with alternating high bits.
+const unsigned char master_magic[6] = { 0x4e, 0xf5, 0x46, 0xe9, 0x6c, 0xe5 };
+const unsigned char record_magic[4] = { 0x4e, 0xf5, 0x46, 0xd8 };
+
+std::string clean_name(std::string s, char separator)
+{
+	for (auto &c : s) {
+		c &= 0x7f;
+		if (c == separator || c == '/') c = ':';
+		if (c == 0) c = '_';
+	}
+	return s;
+}
+
+bool parse_archive(const std::vector<unsigned char> &data, std::vector<thread_info> &out)
+{
+	if (data.size() < 48 || memcmp(data.data(), master_magic, 6)) return false;
+
+	uint32_t records = read32(&data[8]);
+	size_t pos = 48;
+
+	for (uint32_t r = 0; r < records; ++r) {
+		if (pos + 58 > data.size() || memcmp(&data[pos], record_magic, 4)) return false;
+
+		const unsigned char *h = &data[pos];
+		unsigned attrib_count = read16(h + 6);
+		uint32_t thread_count = read32(h + 10);
+		char separator = h[16];
+		uint32_t extra_type = read32(h + 26);
+		unsigned storage_type = read16(h + 30);
+
+		if (attrib_count < 58 || pos + attrib_count + 2 > data.size()) return false;
+		unsigned name_length = read16(h + attrib_count - 2);
+		std::string name(h + attrib_count, h + attrib_count + std::min<size_t>(name_length, data.size() - pos - attrib_count));
+		pos += attrib_count + name_length;
+
+		size_t headers = pos;
+		pos += (size_t)thread_count * 16;
+		if (pos > data.size()) return false;
+
+		std::vector<thread_info> found;
+		size_t offset = pos;
+		for (uint32_t t = 0; t < thread_count; ++t) {
+			const unsigned char *th = &data[headers + t * 16];
+			unsigned thread_class = read16(th + 0);
+			unsigned format = read16(th + 2);
+			unsigned kind = read16(th + 4);
+			uint32_t size = read32(th + 8);
+			uint32_t comp_size = read32(th + 12);
+
+			if (offset + comp_size > data.size()) return false;
+
+			if (thread_class == THREAD_FILENAME && kind == 0) {
+				name.assign(&data[offset], &data[offset] + std::min(size, comp_size));
+				while (!name.empty() && name.back() == 0) name.pop_back();
+			}
+			if (thread_class == THREAD_DATA && (format == FORMAT_UNCOMPRESSED || format == FORMAT_LZW1 || format == FORMAT_LZW2)) {
+				// disk image sizes are in the record: blocks and block size.
+				if (kind == 1 && storage_type <= 13 && extra_type) size = extra_type * 512;
+				else if (kind == 1 && extra_type) size = extra_type * storage_type;
+				found.push_back({ kind == 2 ? ".rsrc" : kind == 1 ? ".po" : "", format, (uint32_t)offset, comp_size, size });
+			}
+			offset += comp_size;
+		}
+		pos = offset;
+
+		name = clean_name(name, separator);
+		if (name.empty()) name = "record" + std::to_string(r + 1);
+		for (auto &t : found) {
+			t.name = name + t.name;
+			out.push_back(std::move(t));
+		}
+	}
+	return true;
+}
+
+
+bool read_archive(unsigned index, const archive &a, std::vector<unsigned char> &data)
+{
+	prodos_volume v;
+	return v.open(fd, files[index]) && prodos_read_fork(v, a.storage_type, a.key, a.eof, data);
+}
+
+// the archives in a partition, found from the directory alone.
+view *scan(unsigned index)
+{
+	view &vw = *views[index];
+	unsigned generation;
+	{
+		std::lock_guard<std::mutex> lock(generation_mutex);
+		generation = files[index].generation;
+	}
+	// the generation only moves for changes from outside the mount; its own
+	// writes through the partition leave it alone, so -orw rescans each time.
+	if (vw.scanned && vw.generation == generation && !options.rw) return &vw;
+
+	vw.archives.clear();
+	vw.scanned = true;
+	vw.generation = generation;
+
+	prodos_volume v;
+	std::vector<prodos_file> list;
+	if (!v.open(fd, files[index]) || !prodos_list(v, list)) return &vw;
+
+	for (const auto &f : list) {
+		const prodos_entry &e = f.entry;
+		if (e.file_type != 0xe0 || e.aux_type != 0x8002) continue;
+		if (e.storage_type < STORAGE_SEEDLING || e.storage_type > STORAGE_TREE) continue;
+
+		archive a;
+		a.name = clean_name(f.path.substr(1), '/');
+		a.storage_type = e.storage_type;
+		a.key = e.key_pointer;
+		a.eof = e.eof;
+		vw.archives.push_back(std::move(a));
+	}
+	return &vw;
+}
+
+archive *find_archive(unsigned index, view &vw, const std::string &name)
+{
+	for (auto &a : vw.archives) {
+		if (a.name != name) continue;
+		if (!a.parsed) {
+			std::vector<unsigned char> data;
+			a.parsed = true;
+			if (read_archive(index, a, data)) parse_archive(data, a.threads);
+		}
+		return &a;
+	}
+	return nullptr;
+}
+
+// "/NAME.nufx/ARCHIVE/THREAD" -> partition index, archive, thread.
+bool split(const char *path, unsigned &index, std::string &a, std::string &t)
+{
+	std::string s(path + 1);
+	size_t slash = s.find('/');
+	std::string top = s.substr(0, slash);
+	if (top.size() < 5 || top.compare(top.size() - 5, 5, ".nufx")) return false;
+	top.resize(top.size() - 5);
+
+	auto iter = std::find(files.begin(), files.end(), top);
+	if (iter == files.end() || iter->volume.empty()) return false;
+	index = iter - files.begin();
+
+	a.clear();
+	t.clear();
+	if (slash == s.npos) return true;
+	s = s.substr(slash + 1);
+	slash = s.find('/');
+	a = s.substr(0, slash);
+	if (slash != s.npos) t = s.substr(slash + 1);
+	return true;
+}
+
+buffer_ptr load(unsigned index, const archive &a, const thread_info &want)
+{
+	std::vector<unsigned char> data;
+	if (!read_archive(index, a, data)) return nullptr;
+
+	struct job { const thread_info *t; uint64_t key; };
+	std::vector<job> jobs;
+	buffer_ptr rv;
+
+	for (const auto &t : a.threads) {
+		if (t.offset + t.comp_size > data.size()) continue;
+		uint64_t key = fnv(&data[t.offset], t.comp_size) ^ ((uint64_t)t.format << 56) ^ t.size;
+		buffer_ptr p = cache_find(key);
+		if (&t == &want) rv = p;
+		if (!p) jobs.push_back({ &t, key });
+	}
+	if (rv) return rv;
+
+	std::vector<std::thread> workers;
+	std::atomic<unsigned> next(0);
+	unsigned count = std::min<unsigned>(std::max(std::thread::hardware_concurrency(), 1u), jobs.size());
+	for (unsigned i = 0; i < count; ++i) {
+		workers.emplace_back([&](){
+			for (;;) {
+				unsigned j = next++;
+				if (j >= jobs.size()) break;
+				const thread_info &t = *jobs[j].t;
+				auto out = std::make_shared<std::vector<unsigned char>>();
+				if (expand(t.format, &data[t.offset], t.comp_size, t.size, *out))
+					cache_add(jobs[j].key, out);
+			}
+		});
+	}
+	for (auto &w : workers) w.join();
+
+	for (const auto &j : jobs) {
+		if (j.t == &want) return cache_find(j.key);
+	}
+	return nullptr;
+}
+
+
+int nufx_getattr(const char *path, struct stat *stbuf)
+{
+	unsigned index;
+	std::string a, t;
+	if (!split(path, index, a, t)) return base.getattr(path, stbuf);
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode = S_IFDIR | 0555;
+	stbuf->st_nlink = 2;
+	if (a.empty()) return 0;
+
+	view &vw = *views[index];
+	std::lock_guard<std::mutex> lock(vw.mutex);
+	archive *ar = find_archive(index, *scan(index), a);
+	if (!ar) return -ENOENT;
+	if (t.empty()) return 0;
+
+	for (const auto &th : ar->threads) {
+		if (th.name != t) continue;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = th.size;
+		stbuf->st_blocks = (th.size + 511) / 512;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+int nufx_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	unsigned index;
+	std::string a, t;
+
+	if (!strcmp(path, "/")) {
+		int ok = base.readdir(path, buf, filler, offset, fi);
+		if (ok < 0) return ok;
+		for (const auto &f : files) {
+			if (!f.volume.empty()) filler(buf, (f.name + ".nufx").c_str(), NULL, 0);
+		}
+		return 0;
+	}
+	if (!split(path, index, a, t)) return base.readdir(path, buf, filler, offset, fi);
+	if (!t.empty()) return -ENOTDIR;
+
+	view &vw = *views[index];
+	std::lock_guard<std::mutex> lock(vw.mutex);
+	scan(index);
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	if (a.empty()) {
+		for (const auto &ar : vw.archives)
+			filler(buf, ar.name.c_str(), NULL, 0);
+		return 0;
+	}
+
+	archive *ar = find_archive(index, vw, a);
+	if (!ar) return -ENOENT;
+	for (const auto &th : ar->threads)
+		filler(buf, th.name.c_str(), NULL, 0);
+	return 0;
+}
+
+int nufx_open(const char *path, struct fuse_file_info *fi)
+{
+	unsigned index;
+	std::string a, t;
+	if (!split(path, index, a, t)) return base.open(path, fi);
+	if (t.empty()) return -EISDIR;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+
+	view &vw = *views[index];
+	std::lock_guard<std::mutex> lock(vw.mutex);
+	archive *ar = find_archive(index, *scan(index), a);
+	if (!ar) return -ENOENT;
+
+	for (const auto &th : ar->threads) {
+		if (th.name != t) continue;
+		buffer_ptr p = load(index, *ar, th);
+		if (!p) return -EIO;
+		fi->fh = (uintptr_t)new buffer_ptr(p);
+		fi->keep_cache = 1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+// fh is only set for threads.
+int nufx_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const buffer_ptr *p = (const buffer_ptr *)(uintptr_t)fi->fh;
+	if (!p) return base.read(path, buf, size, offset, fi);
+
+	const auto &data = **p;
+	if (offset >= (off_t)data.size()) return 0;
+	size = std::min<size_t>(size, data.size() - offset);
+	memcpy(buf, data.data() + offset, size);
+	return size;
+}
+
+int nufx_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	if (!fi->fh) return base.read_buf(path, bufp, size, offset, fi);
+
+	struct fuse_bufvec *bv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+	char *mem = (char *)malloc(std::max<size_t>(size, 1));
+	if (!bv || !mem) {
+		free(bv);
+		free(mem);
+		return -ENOMEM;
+	}
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->buf[0].mem = mem;
+	bv->buf[0].size = nufx_read(path, mem, size, offset, fi);
+	*bufp = bv;
+	return 0;
+}
+
+int nufx_release(const char *path, struct fuse_file_info *fi)
+{
+	delete (buffer_ptr *)(uintptr_t)fi->fh;
+	fi->fh = 0;
+	return 0;
+}
+
+} // namespace
+
+
+void nufx_setup(struct fuse_operations &ops)
+{
+	views.clear();
+	for (size_t i = 0; i < files.size(); ++i)
+		views.emplace_back(new view);
+	governor_add(memory);
+
+	base = ops;
+	ops.getattr  = nufx_getattr;
+	ops.readdir  = nufx_readdir;
+	ops.open     = nufx_open;
+	ops.read     = nufx_read;
+	ops.read_buf = nufx_read_buf;
+	ops.release  = nufx_release;
+}
@@ -0,0 +1,281 @@
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <set>
+
+#include "cache.h"
+#include "ii-part.h"
+#include "prodos.h"
+
+
+void prodos_parse_entry(const unsigned char *data, prodos_entry &e)
+{
+	e.storage_type = data[0x00] >> 4;
+	e.name.assign(data + 0x01, data + 0x01 + (data[0x00] & 0x0f));
+	e.file_type = data[0x10];
+	e.key_pointer = read16(data + 0x11);
+	e.blocks_used = read16(data + 0x13);
+	e.eof = read24(data + 0x15);
+	e.access = data[0x1e];
+	e.aux_type = read16(data + 0x1f);
+	e.header_pointer = read16(data + 0x25);
+}
+
+
+bool prodos_volume::open(int fd, const file_info &f)
+{
+	unsigned char data[512];
+
+	this->fd = fd;
+	start = f.start;
+	blocks = f.size / 512;
+
+	if (blocks < 3) return false;
+	if (!read(2, 1, data)) return false;
+
+	// volume directory key block: no previous block, volume header entry.
+	if (read16(data + 0x00) != 0) return false;
+	if ((data[0x04] >> 4) != STORAGE_VOLUME_HEADER) return false;
+	if ((data[0x04] & 0x0f) == 0) return false;
+
+	name.assign(data + 0x05, data + 0x05 + (data[0x04] & 0x0f));
+	bitmap_pointer = read16(data + 0x27);
+	total_blocks = read16(data + 0x29);
+
+	if (total_blocks == 0 || bitmap_pointer >= total_blocks) return false;
+	return true;
+}
+
+bool prodos_volume::read(unsigned block, unsigned count, void *buffer) const
+{
+	size_t size = (size_t)count * 512;
+
+	if (block + count > blocks) {
+		errno = EINVAL;
+		return false;
+	}
+
+	ssize_t ok = cache_pread(fd, buffer, size, start + (off_t)block * 512);
+	if (ok < 0) return false;
+	if ((size_t)ok != size) {
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+bool prodos_volume::write(unsigned block, unsigned count, const void *buffer) const
+{
+	size_t size = (size_t)count * 512;
+	off_t offset = start + (off_t)block * 512;
+
+	if (block + count > blocks) {
+		errno = EINVAL;
+		return false;
+	}
+
+	ssize_t ok = pwrite(fd, buffer, size, offset);
+	if (ok > 0) cache_invalidate(offset, ok);
+	if (ok < 0) return false;
+	if ((size_t)ok != size) {
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+
+namespace {
+
+struct dir_pending
+{
+	unsigned block;
+	unsigned dir; // index of the directory in out, or ~0u for the volume
+	bool key;
+	unsigned entry_length;
+	unsigned entries_per_block;
+	unsigned depth;
+};
+
+} // namespace
+
+bool prodos_list(const prodos_volume &v, std::vector<prodos_file> &out)
+{
+	std::vector<dir_pending> next;
+	std::vector<unsigned char> buffer;
+	std::set<unsigned> seen;
+
+	next.push_back({ 2, ~0u, true, 0, 0, 0 });
+	seen.insert(2);
+
+	while (!next.empty()) {
+		std::vector<dir_pending> batch;
+		batch.swap(next);
+
+		if (!prodos_read_sorted(v, batch, buffer)) return false;
+
+		for (size_t i = 0; i < batch.size(); ++i) {
+			const unsigned char *data = buffer.data() + i * 512;
+			dir_pending p = batch[i];
+
+			if (p.key) {
+				unsigned type = data[0x04] >> 4;
+				if (type != STORAGE_VOLUME_HEADER && type != STORAGE_SUBDIR_HEADER) continue;
+				p.entry_length = data[0x23];
+				p.entries_per_block = data[0x24];
+				if (p.entry_length < 0x27 || p.entries_per_block == 0 || 4 + p.entry_length * p.entries_per_block > 512) continue;
+			}
+
+			std::string prefix = p.dir == ~0u ? "" : out[p.dir].path;
+			for (unsigned j = p.key ? 1 : 0; j < p.entries_per_block; ++j) {
+				unsigned offset = 4 + j * p.entry_length;
+				if ((data[offset] >> 4) == STORAGE_DELETED) continue;
+
+				prodos_file f;
+				prodos_parse_entry(data + offset, f.entry);
+				f.path = prefix + "/" + f.entry.name;
+				f.entry_block = p.block;
+				f.entry_offset = offset;
+				f.depth = p.depth;
+				out.push_back(std::move(f));
+
+				const prodos_entry &e = out.back().entry;
+				if (e.storage_type == STORAGE_SUBDIR && e.key_pointer < v.total_blocks && seen.insert(e.key_pointer).second)
+					next.push_back({ e.key_pointer, (unsigned)out.size() - 1, true, 0, 0, p.depth + 1 });
+			}
+
+			unsigned link = read16(data + 2);
+			if (link && link < v.total_blocks && seen.insert(link).second)
+				next.push_back({ link, p.dir, false, p.entry_length, p.entries_per_block, p.depth });
+		}
+	}
+	return true;
+}
+
+bool prodos_fork_blocks(const prodos_volume &v, unsigned storage_type, unsigned key, std::vector<unsigned> &blocks)
+{
+	unsigned char index[512];
+	unsigned char master[512];
+
+	blocks.clear();
+	switch (storage_type) {
+		case STORAGE_SEEDLING:
+			blocks.push_back(key);
+			return true;
+
+		case STORAGE_SAPLING:
+			if (!v.read(key, 1, index)) return false;
+			blocks.push_back(key);
+			for (unsigned i = 0; i < 256; ++i) {
+				unsigned b = index[i] | (index[256 + i] << 8);
+				if (b) blocks.push_back(b);
+			}
+			return true;
+
+		case STORAGE_TREE:
+			if (!v.read(key, 1, master)) return false;
+			blocks.push_back(key);
+			for (unsigned i = 0; i < 256; ++i) {
+				unsigned ib = master[i] | (master[256 + i] << 8);
+				if (!ib) continue;
+				if (ib >= v.blocks || !v.read(ib, 1, index)) return false;
+				blocks.push_back(ib);
+				for (unsigned j = 0; j < 256; ++j) {
+					unsigned b = index[j] | (index[256 + j] << 8);
+					if (b) blocks.push_back(b);
+				}
+			}
+			return true;
+	}
+	errno = EINVAL;
+	return false;
+}
+
+namespace {
+
+struct fork_request
+{
+	unsigned block;
+	unsigned position; // logical block number in the fork
+};
+
+} // namespace
+
+bool prodos_read_fork(const prodos_volume &v, unsigned storage_type, unsigned key, uint32_t eof, std::vector<unsigned char> &data)
+{
+	unsigned count = (eof + 511) / 512;
+	std::vector<fork_request> requests;
+	std::vector<unsigned char> buffer;
+	unsigned char index[512];
+
+	data.assign((size_t)count * 512, 0);
+
+	auto add_index = [&](const unsigned char *ptr, unsigned base){
+		for (unsigned i = 0; i < 256 && base + i < count; ++i) {
+			unsigned b = ptr[i] | (ptr[256 + i] << 8);
+			if (b) requests.push_back({ b, base + i });
+		}
+	};
+
+	switch (storage_type) {
+		case STORAGE_SEEDLING:
+			if (count) requests.push_back({ key, 0 });
+			break;
+
+		case STORAGE_SAPLING:
+			if (!v.read(key, 1, index)) return false;
+			add_index(index, 0);
+			break;
+
+		case STORAGE_TREE: {
+			std::vector<fork_request> indexes;
+			if (!v.read(key, 1, index)) return false;
+			for (unsigned i = 0; i < 128 && i * 256 < count; ++i) {
+				unsigned b = index[i] | (index[256 + i] << 8);
+				if (b) indexes.push_back({ b, i * 256 });
+			}
+			if (!prodos_read_sorted(v, indexes, buffer)) return false;
+			for (size_t i = 0; i < indexes.size(); ++i)
+				add_index(buffer.data() + i * 512, indexes[i].position);
+			break;
+		}
+
+		default:
+			errno = EINVAL;
+			return false;
+	}
+
+	if (!prodos_read_sorted(v, requests, buffer)) return false;
+	for (size_t i = 0; i < requests.size(); ++i)
+		memcpy(&data[(size_t)requests[i].position * 512], &buffer[i * 512], 512);
+
+	data.resize(eof);
+	return true;
+}
+
+bool prodos_directory_blocks(const prodos_volume &v, unsigned key, std::vector<unsigned> &blocks)
+{
+	unsigned char data[512];
+
+	blocks.clear();
+	for (unsigned block = key; block; block = read16(data + 2)) {
+		if (block >= v.total_blocks || blocks.size() >= v.total_blocks) {
+			errno = EINVAL;
+			return false;
+		}
+		if (!v.read(block, 1, data)) return false;
+		blocks.push_back(block);
+	}
+	return true;
+}
+
+unsigned prodos_extents(const std::vector<unsigned> &blocks)
+{
+	unsigned count = 0;
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		if (i == 0 || blocks[i] != blocks[i - 1] + 1) ++count;
+	}
+	return count;
+}
@@ -0,0 +1,114 @@
+#ifndef prodos_h
+#define prodos_h
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct file_info;
+
+enum {
+	STORAGE_DELETED = 0x0,
+	STORAGE_SEEDLING = 0x1,
+	STORAGE_SAPLING = 0x2,
+	STORAGE_TREE = 0x3,
+	STORAGE_PASCAL = 0x4,
+	STORAGE_EXTENDED = 0x5,
+	STORAGE_SUBDIR = 0xd,
+	STORAGE_SUBDIR_HEADER = 0xe,
+	STORAGE_VOLUME_HEADER = 0xf,
+};
+
+// a file entry in a directory block.
+struct prodos_entry
+{
+	unsigned storage_type = 0;
+	std::string name;
+	unsigned file_type = 0;
+	unsigned key_pointer = 0;
+	unsigned blocks_used = 0;
+	uint32_t eof = 0;
+	unsigned access = 0;
+	unsigned aux_type = 0;
+	unsigned header_pointer = 0;
+};
+
+void prodos_parse_entry(const unsigned char *data, prodos_entry &e);
+
+
+// a ProDOS volume living in a partition.
+struct prodos_volume
+{
+	int fd = -1;
+	off_t start = 0;
+	unsigned blocks = 0; // size of the partition
+
+	std::string name;
+	unsigned total_blocks = 0; // according to the volume header
+	unsigned bitmap_pointer = 0;
+
+	// false if the partition doesn't hold a ProDOS volume.
+	bool open(int fd, const file_info &f);
+
+	bool read(unsigned block, unsigned count, void *buffer) const;
+	bool write(unsigned block, unsigned count, const void *buffer) const;
+
+	unsigned bitmap_blocks() const { return (total_blocks + 4095) / 4096; }
+};
+
+
+// a file (or subdirectory) and where its entry lives.
+struct prodos_file
+{
+	std::string path;
+	prodos_entry entry;
+	unsigned entry_block = 0;
+	unsigned entry_offset = 0;
+	unsigned depth = 0;
+};
+
+// every entry in the volume, breadth first. directory blocks are read a
+// level at a time.
+bool prodos_list(const prodos_volume &v, std::vector<prodos_file> &out);
+
+// every block of a seedling/sapling/tree fork in storage order: index
+// blocks first, each followed by the data blocks it points to. sparse
+// holes are skipped.
+bool prodos_fork_blocks(const prodos_volume &v, unsigned storage_type, unsigned key, std::vector<unsigned> &blocks);
+
+// the contents of a seedling/sapling/tree fork, eof bytes long. sparse
+// blocks read as zeros.
+bool prodos_read_fork(const prodos_volume &v, unsigned storage_type, unsigned key, uint32_t eof, std::vector<unsigned char> &data);
+
+// the blocks of a directory, following the chain from its key block.
+bool prodos_directory_blocks(const prodos_volume &v, unsigned key, std::vector<unsigned> &blocks);
+
+// number of contiguous runs.
+unsigned prodos_extents(const std::vector<unsigned> &blocks);
+
+
+// reads the blocks named by requests (anything with a block member) in
+// ascending order, merging neighbours into single reads. on return the
+// requests are sorted and requests[i] lives at buffer[i * 512].
+template <class T>
+bool prodos_read_sorted(const prodos_volume &v, std::vector<T> &requests, std::vector<unsigned char> &buffer)
+{
+	std::sort(requests.begin(), requests.end(), [](const T &a, const T &b){
+		return a.block < b.block;
+	});
+
+	buffer.resize(requests.size() * 512);
+	for (size_t i = 0; i < requests.size(); ) {
+		size_t j = i + 1;
+		while (j < requests.size() && j - i < 128 && requests[j].block == requests[j - 1].block + 1) ++j;
+
+		if (!v.read(requests[i].block, j - i, buffer.data() + i * 512)) return false;
+		i = j;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "rangelock.h"
+
+/*
+ * A bucket's state is the number of readers, or writer_bit. A stripe maps to
+ * bucket (stripe % buckets), so a range is a run of consecutive buckets
+ * (wrapping around); the run is taken lowest bucket first.
+ */
+
+namespace {
+
+const unsigned stripe_shift = 16; // 64 KiB
+const unsigned buckets = 256;
+const uint32_t writer_bit = 0x80000000;
+
+struct bucket
+{
+	std::atomic<uint32_t> state{0};
+	std::atomic<uint32_t> waiters{0};
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+// never destroyed: fuse threads may still hold a bucket at exit.
+bucket *table = new bucket[buckets];
+
+bool try_lock(bucket &b, bool exclusive)
+{
+	uint32_t s = b.state.load(std::memory_order_relaxed);
+	if (exclusive) return s == 0 && b.state.compare_exchange_strong(s, writer_bit, std::memory_order_acquire);
+
+	while (!(s & writer_bit)) {
+		if (b.state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) return true;
+	}
+	return false;
+}
+
+void lock(bucket &b, bool exclusive)
+{
+	if (try_lock(b, exclusive)) return;
+
+	// waiters is raised before the state is looked at again, and the
+	// unlocker looks at waiters after changing the state, so one of the
+	// two always sees the other.
+	b.waiters.fetch_add(1, std::memory_order_seq_cst);
+	std::unique_lock<std::mutex> guard(b.mutex);
+	b.cv.wait(guard, [&]{ return try_lock(b, exclusive); });
+	b.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void unlock(bucket &b, bool exclusive)
+{
+	if (exclusive) b.state.store(0, std::memory_order_seq_cst);
+	else b.state.fetch_sub(1, std::memory_order_seq_cst);
+
+	if (b.waiters.load(std::memory_order_seq_cst)) {
+		std::lock_guard<std::mutex> guard(b.mutex);
+		b.cv.notify_all();
+	}
+}
+
+} // namespace
+
+
+range_lock::range_lock(off_t offset, off_t size, bool exclusive) : exclusive(exclusive)
+{
+	uint64_t begin = (uint64_t)offset >> stripe_shift;
+	uint64_t end = size > 0 ? ((uint64_t)(offset + size - 1) >> stripe_shift) + 1 : begin;
+
+	count = end - begin < buckets ? end - begin : buckets;
+	first = count == buckets ? 0 : begin % buckets;
+
+	// ascending: the part from first to the end of the table, then the
+	// part that wrapped around, which is below first.
+	unsigned wrapped = first + count > buckets ? first + count - buckets : 0;
+	for (unsigned i = 0; i < wrapped; ++i) lock(table[i], exclusive);
+	for (unsigned i = first; i < first + count - wrapped; ++i) lock(table[i], exclusive);
+}
+
+range_lock::~range_lock()
+{
+	for (unsigned i = 0; i < count; ++i)
+		unlock(table[(first + i) % buckets], exclusive);
+}
@@ -0,0 +1,43 @@
+#ifndef rangelock_h
+#define rangelock_h
+
+#include <sys/types.h>
+
+/*
+ * Locks on byte ranges of the device, so a write is never seen half done
+ * by a read of the same blocks (or by the cache loading them).
+ *
+ * The device is divided into stripes, and stripes are hashed onto a fixed
+ * set of reader/writer buckets. Taking a bucket is a single compare and
+ * swap unless it is held in the other mode; only then does anyone touch a
+ * mutex. Buckets are always taken in ascending order, so requests spanning
+ * several can't deadlock.
+ */
+
+class range_lock
+{
+public:
+	static constexpr bool enabled = true;
+
+	range_lock(off_t offset, off_t size, bool exclusive);
+	~range_lock();
+
+	range_lock(const range_lock &) = delete;
+	range_lock &operator=(const range_lock &) = delete;
+
+private:
+	unsigned first;
+	unsigned count;
+	bool exclusive;
+};
+
+// for read-only mounts, where there's nothing to lock against.
+class no_range_lock
+{
+public:
+	static constexpr bool enabled = false;
+
+	no_range_lock(off_t, off_t, bool) {}
+};
+
+#endif
@@ -0,0 +1,353 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ii-part.h"
+#include "prodos.h"
+
+/*
+ * --repartition=NAME:BLOCKS[,NAME:BLOCKS...]: resize partitions in place.
+ *
+ * Partitions keep their order. Each one stays where it is unless the one
+ * before it has grown into it, so shrinking moves nothing and growing
+ * moves only what follows (the image file grows to make room). If that
+ * doesn't fit a block device, everything is packed to the left instead.
+ *
+ * Right-movers are copied last partition first, back to front; left-movers
+ * first partition first, front to back. Chunks are never larger than the
+ * distance moved, so a chunk's source and destination never overlap and
+ * any chunk can be copied again after a crash. Progress is recorded in a
+ * journal after every chunk; running the same command again resumes. The
+ * header is written last, then the journal is removed.
+ *
+ * ProDOS volumes are not resized: a partition can't shrink below its
+ * volume, and a grown partition has room for a larger volume later.
+ */
+
+namespace {
+
+struct move
+{
+	off_t old_start;
+	off_t old_size;
+	off_t new_start;
+	off_t new_size;
+};
+
+const off_t max_chunk = 1 << 20;
+const off_t journal_progress = 4096; // offset of the progress record
+const char journal_magic[] = "ii-part-fuse repartition\n";
+
+std::string journal_path(const char *filename)
+{
+	struct stat st;
+	if (stat(filename, &st) == 0 && S_ISREG(st.st_mode))
+		return std::string(filename) + ".repartition";
+
+	// don't write next to a device node.
+	const char *base = strrchr(filename, '/');
+	return std::string(base ? base + 1 : filename) + ".repartition";
+}
+
+bool write_journal(int jfd, const std::vector<move> &plan)
+{
+	std::string s = journal_magic;
+	char line[128];
+
+	for (const auto &m : plan) {
+		snprintf(line, sizeof(line), "%lld %lld %lld %lld\n",
+			(long long)m.old_start / 512, (long long)m.old_size / 512,
+			(long long)m.new_start / 512, (long long)m.new_size / 512);
+		s += line;
+	}
+	if (s.size() >= journal_progress) return false;
+	s.resize(journal_progress, 0);
+	return pwrite(jfd, s.data(), s.size(), 0) == (ssize_t)s.size();
+}
+
+bool read_journal(int jfd, std::vector<move> &plan)
+{
+	std::vector<char> buffer(journal_progress + 1, 0);
+	if (pread(jfd, buffer.data(), journal_progress, 0) != journal_progress) return false;
+	if (strncmp(buffer.data(), journal_magic, strlen(journal_magic))) return false;
+
+	const char *cp = buffer.data() + strlen(journal_magic);
+	long long a, b, c, d;
+	int n;
+	while (sscanf(cp, "%lld %lld %lld %lld\n%n", &a, &b, &c, &d, &n) == 4) {
+		plan.push_back({ a * 512, b * 512, c * 512, d * 512 });
+		cp += n;
+	}
+	return !plan.empty();
+}
+
+bool write_progress(int jfd, unsigned step, off_t done)
+{
+	char record[32];
+	snprintf(record, sizeof(record), "%10u %20lld", step, (long long)done);
+	record[31] = '\n';
+	return pwrite(jfd, record, sizeof(record), journal_progress) == sizeof(record) && fsync(jfd) == 0;
+}
+
+bool read_progress(int jfd, unsigned &step, off_t &done)
+{
+	char record[33] = {};
+	long long d;
+
+	step = 0;
+	done = 0;
+	ssize_t ok = pread(jfd, record, 32, journal_progress);
+	if (ok == 0) return true;
+	if (ok != 32 || sscanf(record, "%u %lld", &step, &d) != 2) return false;
+	done = d;
+	return true;
+}
+
+// copy [0, size) of a partition from one place to another, a chunk at a time.
+bool copy_partition(int jfd, unsigned step, const move &m, off_t done, std::vector<char> &buffer)
+{
+	off_t size = std::min(m.old_size, m.new_size);
+	off_t distance = m.new_start > m.old_start ? m.new_start - m.old_start : m.old_start - m.new_start;
+	off_t chunk = std::min(max_chunk, distance);
+	bool right = m.new_start > m.old_start;
+
+	buffer.resize(chunk);
+	while (done < size) {
+		off_t length = std::min(chunk, size - done);
+		off_t offset = right ? size - done - length : done;
+
+		if (pread(fd, buffer.data(), length, m.old_start + offset) != length) return false;
+		if (pwrite(fd, buffer.data(), length, m.new_start + offset) != length) return false;
+		if (fsync(fd) < 0) return false;
+
+		done += length;
+		if (!write_progress(jfd, step, done)) return false;
+	}
+	return true;
+}
+
+bool parse_sizes(const char *spec, std::vector<move> &plan)
+{
+	std::string s = spec;
+	size_t pos = 0;
+
+	while (pos < s.size()) {
+		size_t end = s.find(',', pos);
+		if (end == s.npos) end = s.size();
+		std::string item = s.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t colon = item.rfind(':');
+		if (colon == item.npos) {
+			warnx("%s: expected NAME:BLOCKS", item.c_str());
+			return false;
+		}
+		std::string name = item.substr(0, colon);
+		char *ep;
+		unsigned long long blocks = strtoull(item.c_str() + colon + 1, &ep, 10);
+		if (*ep || !blocks) {
+			warnx("%s: bad block count", item.c_str());
+			return false;
+		}
+
+		auto iter = std::find(files.begin(), files.end(), name);
+		if (iter == files.end()) {
+			warnx("%s: no such partition", name.c_str());
+			return false;
+		}
+
+		prodos_volume v;
+		if (v.open(fd, *iter) && blocks < v.total_blocks) {
+			warnx("%s: the ProDOS volume needs %u blocks", name.c_str(), v.total_blocks);
+			return false;
+		}
+		plan[iter - files.begin()].new_size = blocks * 512;
+	}
+	return true;
+}
+
+// keep everything in place where possible; pack to the left otherwise.
+bool layout(std::vector<move> &plan, off_t device_size, bool can_grow)
+{
+	std::vector<unsigned> order(plan.size());
+	for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b){
+		return plan[a].old_start < plan[b].old_start;
+	});
+
+	off_t first = plan[order[0]].old_start;
+	off_t end = first;
+	for (unsigned i : order) {
+		if (plan[i].old_start < end) {
+			warnx("%s: partitions overlap", files[i].name.c_str());
+			return false;
+		}
+		end = plan[i].old_start + plan[i].old_size;
+	}
+
+	end = first;
+	for (unsigned i : order) {
+		plan[i].new_start = std::max(plan[i].old_start, end);
+		end = plan[i].new_start + plan[i].new_size;
+	}
+	if (end <= device_size || can_grow) return true;
+
+	end = first;
+	for (unsigned i : order) {
+		plan[i].new_start = end;
+		end += plan[i].new_size;
+	}
+	if (end <= device_size) return true;
+
+	warnx("the new partitions need %lld blocks; the device has %lld", (long long)end / 512, (long long)device_size / 512);
+	return false;
+}
+
+// right-movers from the end, then left-movers from the start.
+std::vector<unsigned> schedule(const std::vector<move> &plan)
+{
+	std::vector<unsigned> right, left;
+	for (unsigned i = 0; i < plan.size(); ++i) {
+		if (plan[i].new_start > plan[i].old_start) right.push_back(i);
+		if (plan[i].new_start < plan[i].old_start) left.push_back(i);
+	}
+	std::sort(right.begin(), right.end(), [&](unsigned a, unsigned b){
+		return plan[a].old_start > plan[b].old_start;
+	});
+	std::sort(left.begin(), left.end(), [&](unsigned a, unsigned b){
+		return plan[a].old_start < plan[b].old_start;
+	});
+	right.insert(right.end(), left.begin(), left.end());
+	return right;
+}
+
+bool same_layout(const std::vector<move> &plan, bool after)
+{
+	if (plan.size() != files.size()) return false;
+	for (size_t i = 0; i < plan.size(); ++i) {
+		off_t start = after ? plan[i].new_start : plan[i].old_start;
+		off_t size = after ? plan[i].new_size : plan[i].old_size;
+		if (files[i].start != start || files[i].size != size) return false;
+	}
+	return true;
+}
+
+} // namespace
+
+
+int repartition(const char *spec)
+{
+	std::vector<move> plan;
+	std::string jpath = journal_path(options.filename);
+	struct stat st;
+
+	if (files.empty()) {
+		warnx("no partitions");
+		return EX_DATAERR;
+	}
+
+	int jfd = open(jpath.c_str(), O_RDWR);
+	if (jfd >= 0) {
+		if (!read_journal(jfd, plan)) {
+			warnx("%s: unreadable journal", jpath.c_str());
+			return EX_DATAERR;
+		}
+		if (same_layout(plan, true)) {
+			// the header made it; only the journal is left.
+			unlink(jpath.c_str());
+			printf("%s: already repartitioned\n", options.filename);
+			return EX_OK;
+		}
+		if (!same_layout(plan, false)) {
+			warnx("%s: journal doesn't match the partition table", jpath.c_str());
+			return EX_DATAERR;
+		}
+		warnx("resuming from %s", jpath.c_str());
+	} else {
+		for (const auto &f : files)
+			plan.push_back({ f.start, f.size, f.start, f.size });
+		if (!parse_sizes(spec, plan)) return EX_USAGE;
+
+		off_t device_size = file_size(fd);
+		bool can_grow = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+		if (!layout(plan, device_size, can_grow)) return EX_DATAERR;
+
+		jfd = open(jpath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+		if (jfd < 0 || !write_journal(jfd, plan) || !write_progress(jfd, 0, 0)) {
+			warn("%s", jpath.c_str());
+			return EX_CANTCREAT;
+		}
+	}
+
+	off_t end = 0;
+	for (const auto &m : plan) end = std::max(end, m.new_start + m.new_size);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < end) {
+		if (ftruncate(fd, end) < 0) {
+			warn("%s", options.filename);
+			return EX_IOERR;
+		}
+	}
+
+	unsigned step;
+	off_t done;
+	if (!read_progress(jfd, step, done)) {
+		warnx("%s: unreadable journal", jpath.c_str());
+		return EX_DATAERR;
+	}
+
+	std::vector<unsigned> moves = schedule(plan);
+	std::vector<char> buffer;
+	off_t copied = 0;
+	for (; step < moves.size(); ++step, done = 0) {
+		const move &m = plan[moves[step]];
+		if (options.verbose)
+			printf("%s: %lld -> %lld\n", files[moves[step]].name.c_str(), (long long)m.old_start / 512, (long long)m.new_start / 512);
+
+		if (!copy_partition(jfd, step, m, done, buffer)) {
+			warn("%s", files[moves[step]].name.c_str());
+			return EX_IOERR;
+		}
+		copied += std::min(m.old_size, m.new_size) - done;
+		if (!write_progress(jfd, step + 1, 0)) {
+			warn("%s", jpath.c_str());
+			return EX_IOERR;
+		}
+	}
+
+	std::vector<unsigned char> header(512 * FOCUS_HEADER_BLOCKS);
+	std::vector<file_info> parts = files;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		parts[i].start = plan[i].new_start;
+		parts[i].size = plan[i].new_size;
+	}
+	if (pread(fd, header.data(), header.size(), 0) != (ssize_t)header.size() || !patch_header(header.data(), parts)) {
+		warnx("%s: unable to update the partition table", options.filename);
+		return EX_DATAERR;
+	}
+	if (pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size() || fsync(fd) < 0) {
+		warn("%s", options.filename);
+		return EX_IOERR;
+	}
+
+	close(jfd);
+	unlink(jpath.c_str());
+
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (options.verbose)
+			printf("%zu: %-20s %8lld %8lld\n", i + 1, parts[i].name.c_str(),
+				(long long)parts[i].start / 512, (long long)parts[i].size / 512);
+	}
+	printf("%s: %zu partitions moved, %lld blocks copied\n", options.filename, moves.size(), (long long)copied / 512);
+	return EX_OK;
+}
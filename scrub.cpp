@@ -0,0 +1,290 @@
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "chd.h"
+#include "ii-part.h"
+#include "rangelock.h"
+
+/*
+ * -oscrub=PATH: re-read the partitions in the background and compare every
+ * block with its CRC-32C in the sidecar file PATH, to catch the card
+ * changing underneath us.
+ *
+ * The sidecar is a 16-byte header ("IIPCRC1\0", then the device size in
+ * blocks) and a 32-bit CRC (host order) per 512-byte block, mapped shared
+ * so it is saved as we go. 0 means "not known yet" (a CRC that really is 0
+ * is stored as 1). Our own writes set their blocks back to 0, so the next
+ * pass records the new contents instead of reporting them. Anything else
+ * that changes the image (another process, or --defragment run without the
+ * sidecar) is reported as well; delete the sidecar after those.
+ *
+ * The scrubber reads 1 MiB at a time straight from the backend (not through
+ * the cache, which it would only flush), at most -oscrub_rate MiB/s, and
+ * holds off while requests are arriving. Passes start at most once an hour.
+ */
+
+namespace {
+
+const size_t chunk_size = 1 << 20;
+const unsigned pass_interval = 3600; // seconds
+const unsigned quiet_ms = 100; // no requests for this long before a chunk
+const char magic[8] = { 'I', 'I', 'P', 'C', 'R', 'C', '1', 0 };
+const size_t header_size = 16;
+
+uint32_t *crcs = nullptr; // one per device block
+std::atomic<uint64_t> passes{0};
+std::atomic<uint64_t> blocks_checked{0};
+std::atomic<uint64_t> mismatches{0};
+std::atomic<int64_t> last_mismatch{-1};
+
+
+// software CRC-32C (Castagnoli, reflected), a byte at a time.
+uint32_t crc32c_table[256];
+
+void make_table()
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_table[i] = c;
+	}
+}
+
+uint32_t crc32c_soft(const unsigned char *data, size_t size)
+{
+	uint32_t crc = ~0u;
+	for (size_t i = 0; i < size; ++i)
+		crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hard(const unsigned char *data, size_t size)
+{
+	uint64_t crc = ~0u;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t x;
+		memcpy(&x, data + i, 8);
+		crc = _mm_crc32_u64(crc, x);
+	}
+	return ~(uint32_t)crc;
+}
+
+bool have_hard()
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__ARM_FEATURE_CRC32)
+uint32_t crc32c_hard(const unsigned char *data, size_t size)
+{
+	uint32_t crc = ~0u;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t x;
+		memcpy(&x, data + i, 8);
+		crc = __crc32cd(crc, x);
+	}
+	return ~crc;
+}
+
+bool have_hard()
+{
+	return true;
+}
+#else
+uint32_t crc32c_hard(const unsigned char *data, size_t size)
+{
+	return crc32c_soft(data, size);
+}
+
+bool have_hard()
+{
+	return false;
+}
+#endif
+
+// a 512-byte block, stored form (never 0).
+uint32_t block_crc(const unsigned char *data, bool hard)
+{
+	uint32_t crc = hard ? crc32c_hard(data, 512) : crc32c_soft(data, 512);
+	return crc ? crc : 1;
+}
+
+void report(uint64_t block, const char *partition)
+{
+	++mismatches;
+	last_mismatch = block;
+	syslog(LOG_WARNING, "scrub: %s block %llu changed without a write", partition, (unsigned long long)block);
+	if (options.verbose) warnx("scrub: %s block %llu changed without a write", partition, (unsigned long long)block);
+}
+
+// blocks until there have been no requests for quiet_ms (or a second has
+// gone by; the scrub mustn't starve forever), then for long enough to keep
+// to the rate.
+void pace(uint64_t &requests, const struct timespec &start, uint64_t bytes)
+{
+	for (unsigned waited = 0; waited < 1000; waited += quiet_ms) {
+		uint64_t now = stats_requests();
+		if (now == requests) break;
+		requests = now;
+		usleep(quiet_ms * 1000);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double elapsed = (ts.tv_sec - start.tv_sec) + (ts.tv_nsec - start.tv_nsec) / 1e9;
+	double due = (double)bytes / ((double)options.scrub_rate * (1 << 20));
+	if (due > elapsed) usleep((useconds_t)((due - elapsed) * 1e6));
+}
+
+template <class Lock>
+void scrub_pass(bool hard)
+{
+	std::vector<unsigned char> buffer(chunk_size);
+	uint64_t requests = stats_requests();
+	uint64_t bytes = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (const auto &f : files) {
+		for (off_t offset = 0; offset < f.size; offset += chunk_size) {
+			pace(requests, start, bytes);
+
+			size_t size = std::min<off_t>(chunk_size, f.size - offset);
+			off_t device_offset = f.start + offset;
+
+			// held across the compare, so a write can't slip in between the
+			// read and the CRC update.
+			Lock lock(device_offset, size, false);
+			ssize_t ok = device_pread(fd, buffer.data(), size, device_offset);
+			if (ok != (ssize_t)size) {
+				syslog(LOG_WARNING, "scrub: %s: read error at block %llu", f.name.c_str(),
+					(unsigned long long)(device_offset / 512));
+				continue;
+			}
+
+			for (size_t i = 0; i < size; i += 512) {
+				uint64_t block = (device_offset + i) / 512;
+				uint32_t crc = block_crc(&buffer[i], hard);
+				uint32_t old = crcs[block];
+				if (old && old != crc) report(block, f.name.c_str());
+				crcs[block] = crc;
+			}
+			blocks_checked += size / 512;
+			bytes += size;
+		}
+	}
+	msync(crcs, total_blocks * 4, MS_ASYNC);
+	++passes;
+}
+
+void scrub()
+{
+	bool hard = have_hard();
+	make_table();
+
+	for (;;) {
+		time_t started = time(nullptr);
+		if (options.rw) scrub_pass<range_lock>(hard);
+		else scrub_pass<no_range_lock>(hard);
+
+		time_t next = started + pass_interval;
+		for (time_t now = time(nullptr); now < next; now = time(nullptr))
+			sleep(next - now);
+	}
+}
+
+} // namespace
+
+
+bool scrub_setup(const char *path)
+{
+	int sfd = open(path, O_RDWR | O_CREAT, 0666);
+	if (sfd < 0) {
+		warn("%s", path);
+		return false;
+	}
+
+	// a sidecar cut short (a full disk, a copy that stopped) would fault
+	// when the mapping reaches past its end, so the size has to match too.
+	struct stat st;
+	size_t size = header_size + total_blocks * 4;
+	unsigned char header[header_size];
+	if (fstat(sfd, &st) < 0) {
+		warn("%s", path);
+		close(sfd);
+		return false;
+	}
+	bool fresh = pread(sfd, header, header_size, 0) != (ssize_t)header_size
+		|| memcmp(header, magic, 8) || read32(header + 8) != (uint32_t)total_blocks
+		|| st.st_size != (off_t)size;
+	if (fresh) {
+		if (st.st_size)
+			warnx("%s: not a sidecar for this image; starting over", path);
+
+		memset(header, 0, sizeof(header));
+		memcpy(header, magic, 8);
+		write32(header + 8, total_blocks);
+		if (ftruncate(sfd, 0) < 0 || ftruncate(sfd, size) < 0
+			|| pwrite(sfd, header, header_size, 0) != (ssize_t)header_size) {
+			warn("%s", path);
+			close(sfd);
+			return false;
+		}
+	}
+
+	void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+	close(sfd);
+	if (base == MAP_FAILED) {
+		warn("mmap %s", path);
+		return false;
+	}
+	crcs = (uint32_t *)((unsigned char *)base + header_size);
+	if (options.verbose) printf("scrub: %s, %s CRC-32C\n", path, have_hard() ? "hardware" : "software");
+	return true;
+}
+
+void scrub_start()
+{
+	if (!crcs) return;
+	openlog("ii-part-fuse", LOG_PID, LOG_DAEMON);
+	std::thread(scrub).detach();
+}
+
+void scrub_written(off_t offset, off_t size)
+{
+	if (!crcs || size <= 0) return;
+
+	uint64_t first = offset / 512;
+	uint64_t last = (offset + size - 1) / 512;
+	for (uint64_t block = first; block <= last && block < (uint64_t)total_blocks; ++block)
+		crcs[block] = 0;
+}
+
+void scrub_get_stats(scrub_stats &stats)
+{
+	stats.enabled = crcs != nullptr;
+	stats.passes = passes;
+	stats.blocks = blocks_checked;
+	stats.mismatches = mismatches;
+	stats.last_mismatch = last_mismatch;
+}
@@ -0,0 +1,432 @@
+
+#include <err.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// macOS has no MSG_NOSIGNAL; SIGPIPE is ignored, so it isn't needed there.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+#include "chd.h"
+#include "ii-part.h"
+
+/*
+ * --serve=PORT: serve the partitions over HTTP on 127.0.0.1:PORT, for
+ * emulators running in a browser, which can then fetch just the blocks
+ * they need.
+ *
+ * GET /NAME (or HEAD) is the partition, with a single byte range honored
+ * (several ranges get the whole partition, which HTTP allows); %XX escapes
+ * in NAME are decoded. GET / lists the partitions, one "NAME SIZE" line
+ * each. Every response allows any origin, so a page served from elsewhere
+ * can use it.
+ *
+ * The ETag is a hash of the partition's contents, computed on first use
+ * and again after the image's mtime changes, so If-None-Match and If-Range
+ * work across restarts. (A block device's mtime doesn't move when it's
+ * written; restart the server after changing one underneath it.)
+ *
+ * On a plain image without -ocache, bodies are sent with sendfile(2) from
+ * the device at the partition's offset; otherwise (a CHD, -oslow, the
+ * cache, or not Linux) they are read 1 MiB at a time and sent.
+ *
+ * Each connection gets a thread, and is closed after a minute idle.
+ */
+
+namespace {
+
+const size_t chunk_size = 1 << 20;
+const size_t max_header = 8192;
+const unsigned idle_seconds = 60;
+
+const char cors_headers[] =
+	"Access-Control-Allow-Origin: *\r\n"
+	"Access-Control-Expose-Headers: Accept-Ranges, Content-Length, Content-Range, ETag\r\n";
+
+// a mutex each, so hashing one partition holds up only the requests for
+// that one, which want the same hash anyway.
+struct etag_entry
+{
+	std::mutex mutex;
+	uint64_t mtime = 0;
+	std::string etag; // quoted; empty until computed
+};
+
+std::vector<etag_entry> etags; // parallel to files
+bool zero_copy = false;
+
+struct request
+{
+	std::string method;
+	std::string target;
+	std::string version;
+	std::vector<std::pair<std::string, std::string>> headers;
+
+	const char *header(const char *name) const
+	{
+		for (const auto &h : headers) {
+			if (!strcasecmp(h.first.c_str(), name)) return h.second.c_str();
+		}
+		return nullptr;
+	}
+};
+
+
+uint64_t backing_mtime()
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 ? mtime_ns(st) : 0;
+}
+
+bool partition_etag(size_t index, std::string &etag)
+{
+	const file_info &f = files[index];
+	uint64_t mtime = backing_mtime();
+
+	etag_entry &e = etags[index];
+	std::lock_guard<std::mutex> lock(e.mutex);
+	if (e.etag.empty() || e.mtime != mtime) {
+		std::vector<unsigned char> buffer(chunk_size);
+		uint64_t hash = fnv(nullptr, 0);
+		for (off_t offset = 0; offset < f.size; offset += chunk_size) {
+			size_t size = std::min<off_t>(chunk_size, f.size - offset);
+			if (cache_pread(fd, buffer.data(), size, f.start + offset) != (ssize_t)size) return false;
+			hash = fnv(buffer.data(), size, hash);
+		}
+		char tmp[24];
+		snprintf(tmp, sizeof(tmp), "\"%016llx\"", (unsigned long long)hash);
+		e.etag = tmp;
+		e.mtime = mtime;
+	}
+	etag = e.etag;
+	return true;
+}
+
+// 1 with a request, 0 if the client went away (or idled out), -1 if it sent
+// something that isn't one. pending carries anything read past the request.
+int read_request(int sock, std::string &pending, request &r)
+{
+	size_t end;
+	while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+		if (pending.size() > max_header) return -1;
+		char buffer[4096];
+		ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		pending.append(buffer, n);
+	}
+	std::string text = pending.substr(0, end + 2);
+	pending.erase(0, end + 4);
+
+	size_t pos = text.find("\r\n");
+	std::string line = text.substr(0, pos);
+	size_t a = line.find(' ');
+	size_t b = a == std::string::npos ? a : line.find(' ', a + 1);
+	if (b == std::string::npos) return -1;
+	r.method = line.substr(0, a);
+	r.target = line.substr(a + 1, b - a - 1);
+	r.version = line.substr(b + 1);
+	if (r.version.compare(0, 5, "HTTP/")) return -1;
+
+	for (pos += 2; pos < text.size(); ) {
+		size_t eol = text.find("\r\n", pos);
+		std::string h = text.substr(pos, eol - pos);
+		pos = eol + 2;
+		size_t colon = h.find(':');
+		if (colon == std::string::npos) return -1;
+		size_t value = h.find_first_not_of(" \t", colon + 1);
+		r.headers.emplace_back(h.substr(0, colon), value == std::string::npos ? "" : h.substr(value));
+	}
+	return 1;
+}
+
+bool parse_number(const char *&cp, off_t &out)
+{
+	if (*cp < '0' || *cp > '9') return false;
+	char *end;
+	out = strtoll(cp, &end, 10);
+	cp = end;
+	return out >= 0;
+}
+
+// a single "bytes=FIRST-LAST", "bytes=FIRST-" or "bytes=-SUFFIX". 1 if
+// [first, last] is the range, 0 if the header is to be ignored (malformed,
+// or several ranges), -1 if it can't be satisfied.
+int parse_range(const char *value, off_t size, off_t &first, off_t &last)
+{
+	if (strncasecmp(value, "bytes=", 6) || strchr(value, ',')) return 0;
+	const char *cp = value + 6;
+	off_t a, b;
+
+	if (*cp == '-') {
+		if (!parse_number(++cp, b) || *cp) return 0;
+		if (!b || !size) return -1;
+		first = size - std::min(b, size);
+		last = size - 1;
+		return 1;
+	}
+
+	if (!parse_number(cp, a) || *cp++ != '-') return 0;
+	b = size - 1;
+	if (*cp && (!parse_number(cp, b) || *cp || b < a)) return 0;
+	if (a >= size) return -1;
+	first = a;
+	last = std::min(b, size - 1);
+	return 1;
+}
+
+bool send_all(int sock, const char *data, size_t size)
+{
+	while (size) {
+		ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool send_body(int sock, off_t offset, off_t size)
+{
+	#ifdef __linux__
+	if (zero_copy) {
+		while (size > 0) {
+			ssize_t n = sendfile(sock, fd, &offset, std::min<off_t>(size, 1 << 30));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			size -= n;
+		}
+		return true;
+	}
+	#endif
+
+	std::vector<unsigned char> buffer(std::min<off_t>(size, chunk_size));
+	while (size > 0) {
+		size_t n = std::min<off_t>(size, chunk_size);
+		if (cache_pread(fd, buffer.data(), n, offset) != (ssize_t)n) return false;
+		if (!send_all(sock, (const char *)buffer.data(), n)) return false;
+		offset += n;
+		size -= n;
+	}
+	return true;
+}
+
+// status line and headers, then body (unless it's a HEAD).
+bool send_response(int sock, const request &r, const char *status, const std::string &headers,
+	const std::string &body, bool keep_alive)
+{
+	std::string head = "HTTP/1.1 ";
+	head += status;
+	head += "\r\n";
+	head += cors_headers;
+	head += headers;
+	head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	if (!keep_alive) head += "Connection: close\r\n";
+	head += "\r\n";
+	if (r.method != "HEAD") head += body;
+	return send_all(sock, head.data(), head.size()) && keep_alive;
+}
+
+bool serve_partition(int sock, const request &r, size_t index, bool keep_alive)
+{
+	const file_info &f = files[index];
+	std::string etag;
+	if (!partition_etag(index, etag))
+		return send_response(sock, r, "500 Internal Server Error", "", "read error\n", false);
+
+	std::string headers = "Accept-Ranges: bytes\r\nETag: " + etag + "\r\nCache-Control: no-cache\r\n";
+
+	const char *match = r.header("If-None-Match");
+	if (match && (strstr(match, etag.c_str()) || !strcmp(match, "*")))
+		return send_response(sock, r, "304 Not Modified", headers, "", keep_alive);
+
+	off_t first = 0, last = f.size - 1;
+	int ranged = 0;
+	const char *range = r.header("Range");
+	const char *if_range = r.header("If-Range");
+	if (range && (!if_range || etag == if_range)) ranged = parse_range(range, f.size, first, last);
+	if (ranged < 0) {
+		headers += "Content-Range: bytes */" + std::to_string(f.size) + "\r\n";
+		return send_response(sock, r, "416 Range Not Satisfiable", headers, "", keep_alive);
+	}
+
+	off_t size = last - first + 1;
+	std::string head = "HTTP/1.1 ";
+	head += ranged ? "206 Partial Content\r\n" : "200 OK\r\n";
+	head += cors_headers;
+	head += headers;
+	head += "Content-Type: application/octet-stream\r\n";
+	head += "Content-Length: " + std::to_string(size) + "\r\n";
+	if (ranged) {
+		head += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last)
+			+ "/" + std::to_string(f.size) + "\r\n";
+	}
+	if (!keep_alive) head += "Connection: close\r\n";
+	head += "\r\n";
+
+	if (options.verbose) printf("%s /%s %s %lld-%lld\n", r.method.c_str(), f.name.c_str(),
+		ranged ? "206" : "200", (long long)first, (long long)last);
+
+	if (!send_all(sock, head.data(), head.size())) return false;
+	if (r.method == "HEAD" || !size) return keep_alive;
+
+	stats_account(f.start + first, size, false);
+	// a failure part way through can't be reported any more; the client
+	// sees the connection close short of Content-Length.
+	return send_body(sock, f.start + first, size) && keep_alive;
+}
+
+int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// %XX escapes, as a browser sends for spaces and the like in a name.
+// false on a malformed one.
+bool percent_decode(const std::string &in, std::string &out)
+{
+	out.clear();
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i] != '%') {
+			out += in[i];
+			continue;
+		}
+		int hi = i + 2 < in.size() ? hex_digit(in[i + 1]) : -1;
+		int lo = hi < 0 ? -1 : hex_digit(in[i + 2]);
+		if (lo < 0) return false;
+		out += (char)(hi << 4 | lo);
+		i += 2;
+	}
+	return true;
+}
+
+// false to close the connection.
+bool respond(int sock, const request &r)
+{
+	const char *connection = r.header("Connection");
+	bool keep_alive = r.version == "HTTP/1.1" && !(connection && !strcasecmp(connection, "close"));
+
+	if (r.method == "OPTIONS") {
+		return send_response(sock, r, "204 No Content",
+			"Access-Control-Allow-Methods: GET, HEAD, OPTIONS\r\n"
+			"Access-Control-Allow-Headers: Range, If-None-Match, If-Range\r\n"
+			"Access-Control-Max-Age: 86400\r\n", "", keep_alive);
+	}
+	if (r.method != "GET" && r.method != "HEAD")
+		return send_response(sock, r, "405 Method Not Allowed", "Allow: GET, HEAD, OPTIONS\r\n", "", keep_alive);
+
+	std::string path;
+	if (!percent_decode(r.target.substr(0, r.target.find('?')), path))
+		return send_response(sock, r, "400 Bad Request", "", "", false);
+	if (path == "/") {
+		std::string body;
+		for (const auto &f : files) body += f.name + " " + std::to_string(f.size) + "\n";
+		return send_response(sock, r, "200 OK", "Content-Type: text/plain\r\n", body, keep_alive);
+	}
+
+	auto iter = path.empty() ? files.end() : std::find(files.begin(), files.end(), path.substr(1));
+	if (iter == files.end())
+		return send_response(sock, r, "404 Not Found", "Content-Type: text/plain\r\n", "no such partition\n", keep_alive);
+	return serve_partition(sock, r, iter - files.begin(), keep_alive);
+}
+
+void connection(int sock)
+{
+	struct timeval tv = { idle_seconds, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	std::string pending;
+	for (;;) {
+		request r;
+		int ok = read_request(sock, pending, r);
+		if (!ok) break;
+		if (ok < 0) {
+			r.method = "GET";
+			send_response(sock, r, "400 Bad Request", "", "", false);
+			break;
+		}
+		if (!respond(sock, r)) break;
+	}
+	close(sock);
+}
+
+} // namespace
+
+
+int serve_partitions(unsigned port)
+{
+	if (!port || port > 65535) {
+		warnx("--serve: bad port %u", port);
+		return EX_USAGE;
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		warn("socket");
+		return EX_OSERR;
+	}
+	int one = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	// loopback only: there's no authentication.
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+		warn("127.0.0.1:%u", port);
+		close(sock);
+		return EX_UNAVAILABLE;
+	}
+
+	etags = std::vector<etag_entry>(files.size());
+	#ifdef __linux__
+	zero_copy = !chd_enabled() && !slow_enabled() && !cache_enabled();
+	#endif
+	// sendfile raises SIGPIPE when the client has gone; send has MSG_NOSIGNAL.
+	signal(SIGPIPE, SIG_IGN);
+	chd_start();
+
+	printf("serving %zu partitions at http://127.0.0.1:%u/\n", files.size(), port);
+	fflush(stdout);
+
+	for (;;) {
+		int c = accept(sock, nullptr, nullptr);
+		if (c < 0) {
+			// out of descriptors, say; let some connections close.
+			if (errno != EINTR && errno != ECONNABORTED) {
+				warn("accept");
+				sleep(1);
+			}
+			continue;
+		}
+		std::thread(connection, c).detach();
+	}
+}
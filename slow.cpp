@@ -0,0 +1,207 @@
+
+#include <err.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include "ii-part.h"
+
+/*
+ * -oslow=PROFILE[:KEY=N...]: make the device behave like a slow one, so
+ * the cache, -osplit and the like can be measured on any machine.
+ *
+ * Every device access (device_pread and device_pwrite, so under the cache)
+ * is charged a command overhead, a seek and half a rotation if it doesn't
+ * start where the last one ended, and its size at the transfer rate. The
+ * device does one command at a time: an access waits for the ones before
+ * it, then for its own time. Seeks grow with the square root of the
+ * distance, full stroke at the far end of the device.
+ *
+ * Profiles (rough figures for the real thing):
+ *   cf    300 us a command, 20 MB/s read, 8 MB/s write, no seeks
+ *   zip   500 us a command, 1.4 MB/s, 50 ms full stroke, 2941 rpm
+ *   none  no delays (errors only, with errors=)
+ *
+ * Keys, to override the profile: latency=US, read=KiB/s, write=KiB/s
+ * (0 for unlimited), seek=US (full stroke), rotation=US (half a turn),
+ * errors=N (failures per million accesses, as EIO), seed=N (which ones
+ * fail), sleep=0 (only count the time; don't wait it out).
+ *
+ * Failures are picked by hashing the seed with the access number, so a
+ * single-threaded run fails the same accesses every time. slow.busy_ms
+ * on the root is the simulated device time so far, which doesn't depend on
+ * the host at all.
+ */
+
+namespace {
+
+struct profile
+{
+	const char *name;
+	unsigned latency; // us
+	unsigned read; // KiB/s
+	unsigned write; // KiB/s
+	unsigned seek; // us, full stroke
+	unsigned rotation; // us
+	unsigned errors; // per million
+};
+
+const profile profiles[] = {
+	{ "cf",   300, 19500, 7800,     0,     0, 0 },
+	{ "zip",  500,  1370, 1370, 50000, 10200, 0 },
+	{ "none",   0,     0,    0,     0,     0, 0 },
+};
+
+profile model;
+bool enabled = false;
+bool sleeping = true;
+uint64_t seed = 1;
+off_t device_size = 0;
+
+std::mutex mutex;
+uint64_t busy_until = 0; // ns, CLOCK_MONOTONIC
+off_t head = 0;
+uint64_t sequence = 0;
+
+std::atomic<uint64_t> requests{0};
+std::atomic<uint64_t> errors{0};
+std::atomic<uint64_t> busy_ns{0};
+
+
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// relative sleeps, so it works without clock_nanosleep (macOS).
+void sleep_until(uint64_t ns)
+{
+	for (uint64_t now = now_ns(); now < ns; now = now_ns()) {
+		struct timespec ts;
+		ts.tv_sec = (ns - now) / 1000000000;
+		ts.tv_nsec = (ns - now) % 1000000000;
+		nanosleep(&ts, nullptr);
+	}
+}
+
+// splitmix64
+uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+uint64_t seek_ns(off_t from, off_t to)
+{
+	if (from == to) return 0;
+	if (!model.seek && !model.rotation) return 0;
+
+	double distance = (double)std::abs(to - from) / std::max<off_t>(device_size, 1);
+	return (uint64_t)(model.seek * 1000.0 * std::sqrt(std::min(distance, 1.0))) + model.rotation * 1000ull;
+}
+
+bool set_key(const std::string &key, unsigned long value)
+{
+	if (key == "latency") model.latency = value;
+	else if (key == "read") model.read = value;
+	else if (key == "write") model.write = value;
+	else if (key == "seek") model.seek = value;
+	else if (key == "rotation") model.rotation = value;
+	else if (key == "errors") model.errors = std::min(value, 1000000ul);
+	else if (key == "seed") seed = value;
+	else if (key == "sleep") sleeping = value != 0;
+	else return false;
+	return true;
+}
+
+} // namespace
+
+
+void slow_setup(const char *spec, off_t size)
+{
+	std::string list = spec;
+	size_t end = std::min(list.find(':'), list.size());
+	std::string name = list.substr(0, end);
+
+	auto iter = std::find_if(std::begin(profiles), std::end(profiles),
+		[&](const profile &p) { return name == p.name; });
+	if (iter == std::end(profiles))
+		errx(1, "-oslow: unknown profile %s (cf, zip or none)", name.c_str());
+	model = *iter;
+
+	for (size_t pos = end + 1; pos < list.size(); ) {
+		end = std::min(list.find(':', pos), list.size());
+		std::string item = list.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t eq = item.find('=');
+		char *tail = nullptr;
+		unsigned long value = eq == std::string::npos ? 0 : strtoul(item.c_str() + eq + 1, &tail, 10);
+		if (!tail || tail == item.c_str() + eq + 1 || *tail || !set_key(item.substr(0, eq), value))
+			errx(1, "-oslow: bad setting %s", item.c_str());
+	}
+
+	device_size = size;
+	enabled = true;
+	if (options.verbose) {
+		printf("slow: %s, %u us a command, read %u KiB/s, write %u KiB/s, seek %u us, rotation %u us, %u errors per million%s\n",
+			name.c_str(), model.latency, model.read, model.write, model.seek, model.rotation, model.errors,
+			sleeping ? "" : ", not sleeping");
+	}
+}
+
+bool slow_enabled()
+{
+	return enabled;
+}
+
+bool slow_io(off_t offset, size_t size, bool write)
+{
+	if (!enabled) return true;
+
+	unsigned rate = write ? model.write : model.read;
+	uint64_t cost = model.latency * 1000ull;
+	if (rate) cost += (uint64_t)size * 1000000000 / ((uint64_t)rate << 10);
+
+	uint64_t done;
+	bool fail;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cost += seek_ns(head, offset);
+		fail = model.errors && mix(seed + sequence++) % 1000000 < model.errors;
+		done = std::max(now_ns(), busy_until) + cost;
+		busy_until = done;
+		head = offset + size;
+	}
+
+	++requests;
+	busy_ns += cost;
+	if (sleeping) sleep_until(done);
+	if (fail) {
+		++errors;
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+void slow_get_stats(slow_stats &stats)
+{
+	stats.enabled = enabled;
+	stats.requests = requests;
+	stats.errors = errors;
+	stats.busy_ns = busy_ns;
+}
@@ -0,0 +1,103 @@
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "ii-part.h"
+
+/*
+ * Per-partition I/O counters, attributed by device offset, so a read of
+ * .device counts against the partitions it covers just as a read of the
+ * partition itself does.
+ *
+ * The index is the partitions' extents sorted by start; an access finds the
+ * first extent that could overlap it with a binary search and walks on from
+ * there. Bytes outside every partition (the header, gaps) are counted
+ * separately.
+ */
+
+namespace {
+
+struct counters
+{
+	std::atomic<uint64_t> reads{0};
+	std::atomic<uint64_t> read_bytes{0};
+	std::atomic<uint64_t> writes{0};
+	std::atomic<uint64_t> write_bytes{0};
+};
+
+struct extent
+{
+	off_t start;
+	off_t end;
+	size_t index; // into files
+};
+
+std::vector<extent> extents; // sorted by start; overlaps are allowed
+off_t longest = 0; // the longest extent, to bound the search
+std::unique_ptr<counters[]> table; // files.size() + 1, the last for outside
+std::atomic<uint64_t> requests{0};
+
+void add(counters &c, bool write, uint64_t bytes)
+{
+	(write ? c.writes : c.reads).fetch_add(1, std::memory_order_relaxed);
+	(write ? c.write_bytes : c.read_bytes).fetch_add(bytes, std::memory_order_relaxed);
+}
+
+} // namespace
+
+
+void stats_setup()
+{
+	extents.clear();
+	longest = 0;
+	for (size_t i = 0; i < files.size(); ++i) {
+		extents.push_back({ files[i].start, files[i].start + files[i].size, i });
+		longest = std::max(longest, files[i].size);
+	}
+	std::sort(extents.begin(), extents.end(), [](const extent &a, const extent &b) {
+		return a.start < b.start;
+	});
+	table.reset(new counters[files.size() + 1]);
+}
+
+void stats_account(off_t offset, off_t size, bool write)
+{
+	if (!table || size <= 0) return;
+	requests.fetch_add(1, std::memory_order_relaxed);
+
+	off_t end = offset + size;
+	off_t covered = 0;
+
+	// nothing starting before offset - longest can reach offset.
+	auto iter = std::lower_bound(extents.begin(), extents.end(), offset - longest,
+		[](const extent &e, off_t x) { return e.start < x; });
+
+	for (; iter != extents.end() && iter->start < end; ++iter) {
+		off_t begin = std::max(offset, iter->start);
+		off_t stop = std::min(end, iter->end);
+		if (begin >= stop) continue;
+		add(table[iter->index], write, stop - begin);
+		covered += stop - begin;
+	}
+	if (covered < size) add(table[files.size()], write, size - covered);
+}
+
+uint64_t stats_requests()
+{
+	return requests.load(std::memory_order_relaxed);
+}
+
+bool stats_get(size_t index, io_stats &stats)
+{
+	if (!table || index > files.size()) return false;
+
+	const counters &c = table[index];
+	stats.reads = c.reads.load(std::memory_order_relaxed);
+	stats.read_bytes = c.read_bytes.load(std::memory_order_relaxed);
+	stats.writes = c.writes.load(std::memory_order_relaxed);
+	stats.write_bytes = c.write_bytes.load(std::memory_order_relaxed);
+	return true;
+}